@@ -29,8 +29,6 @@
 #include <sigrok.h>
 #include "sigrok-cli.h"
 
-extern int end_acquisition;
-
 #ifdef _WIN32
 HANDLE stdin_handle;
 DWORD stdin_mode;
@@ -43,15 +41,14 @@ static int received_anykey(int fd, int revents, void *user_data)
 	/* Avoid compiler warnings. */
 	fd = fd;
 	revents = revents;
-	user_data = user_data;
 
-	end_acquisition = TRUE;
+	session_halt(user_data);
 
 	return TRUE;
 }
 
 /* Turn off buffering on stdin. */
-void add_anykey(void)
+void add_anykey(struct session *session)
 {
 #ifdef _WIN32
 	stdin_handle = GetStdHandle(STD_INPUT_HANDLE);
@@ -70,7 +67,8 @@ void add_anykey(void)
 	tcsetattr(STDIN_FILENO, TCSADRAIN, &term);
 #endif
 
-	add_source(STDIN_FILENO, G_IO_IN, -1, received_anykey, NULL);
+	session_source_add(session, STDIN_FILENO, G_IO_IN, -1, received_anykey,
+			   session);
 
 	printf("Press any key to stop acquisition.\n");
 }
@@ -37,35 +37,33 @@
 
 #define DEFAULT_OUTPUT_FORMAT "bits64"
 
+/* Packets queued for the datafeed callback, with --bus */
+#define BUS_QUEUE_LEN 256
+
 extern struct hwcap_option hwcap_options[];
 
 gboolean debug = 0;
-int end_acquisition = FALSE;
 uint64_t limit_samples = 0;
-struct output_format *output_format = NULL;
-char *output_format_param = NULL;
+/* List of struct cli_output*, one per --format */
+GSList *cli_outputs = NULL;
 char *input_format_param = NULL;
+int datastore_flags = 0;
+/* Full queue policy for the threaded bus, or -1 to call directly */
+int bus_policy = -1;
 
-/* Protocol decoder */
-struct sigrokdecode_decoder *dec;
-char *current_decoder;
+/* Protocol decoders, as struct analyzer* for the session */
+GSList *analyzers = NULL;
 
-/* These live in hwplugin.c, for the frontend to override. */
-extern source_callback_add source_cb_add;
-extern source_callback_remove source_cb_remove;
+/* The session being run, if any */
+static struct session *session = NULL;
 
-struct source {
-	int fd;
-	int events;
-	int timeout;
-	receive_data_callback cb;
-	void *user_data;
+/* An output format instance, and where its output goes. */
+struct cli_output {
+	struct output o;
+	char *filename;
+	FILE *fp;
 };
 
-struct source *sources = NULL;
-int num_sources = 0;
-int source_timeout = -1;
-
 static gboolean opt_version = FALSE;
 static gboolean opt_list_devices = FALSE;
 static gboolean opt_wait_trigger = FALSE;
@@ -77,10 +75,13 @@ static gchar *opt_probes = NULL;
 static gchar *opt_triggers = NULL;
 static gchar **opt_devoption = NULL;
 static gchar *opt_pds = NULL;
-static gchar *opt_format = NULL;
+static gchar **opt_formats = NULL;
 static gchar *opt_time = NULL;
 static gchar *opt_samples = NULL;
 static gchar *opt_continuous = NULL;
+static gchar *opt_datastore = NULL;
+static gchar *opt_bus = NULL;
+static gchar *opt_pretrigger = NULL;
 
 static GOptionEntry optargs[] = {
 	{"version", 'V', 0, G_OPTION_ARG_NONE, &opt_version, "Show version and support list", NULL},
@@ -92,12 +93,15 @@ static GOptionEntry optargs[] = {
 	{"probes", 'p', 0, G_OPTION_ARG_STRING, &opt_probes, "Probes to use", NULL},
 	{"triggers", 't', 0, G_OPTION_ARG_STRING, &opt_triggers, "Trigger configuration", NULL},
 	{"wait-trigger", 'w', 0, G_OPTION_ARG_NONE, &opt_wait_trigger, "Wait for trigger", NULL},
+	{"pre-trigger", 0, 0, G_OPTION_ARG_STRING, &opt_pretrigger, "Wait for trigger, keeping this many samples from before it", NULL},
 	{"device-option", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &opt_devoption, "Device-specific option", NULL},
 	{"protocol-decoders", 'a', 0, G_OPTION_ARG_STRING, &opt_pds, "Protocol decoder sequence", NULL},
-	{"format", 'f', 0, G_OPTION_ARG_STRING, &opt_format, "Output format", NULL},
+	{"format", 'f', 0, G_OPTION_ARG_STRING_ARRAY, &opt_formats, "Output format, optionally =filename", NULL},
 	{"time", 0, 0, G_OPTION_ARG_STRING, &opt_time, "How long to sample (ms)", NULL},
 	{"samples", 0, 0, G_OPTION_ARG_STRING, &opt_samples, "Number of samples to acquire", NULL},
 	{"continuous", 0, 0, G_OPTION_ARG_NONE, &opt_continuous, "Sample continuously", NULL},
+	{"datastore", 0, 0, G_OPTION_ARG_STRING, &opt_datastore, "Datastore type (memory, mmap, rle)", NULL},
+	{"bus", 0, 0, G_OPTION_ARG_STRING, &opt_bus, "Process samples in a separate thread (block, drop-oldest, drop)", NULL},
 	{NULL, 0, 0, 0, NULL, NULL, NULL}
 };
 
@@ -270,60 +274,357 @@ void show_device_detail(void)
 	}
 }
 
+/*
+ * What datafeed_in() keeps track of for each device, kept in the session
+ * as that device's context.
+ */
+struct device_state {
+	/* Position of the device in the session */
+	int num;
+	struct probe_filter *filter;
+	int probelist[65];
+	int num_enabled_probes;
+	/* Size of a unit after filtering */
+	int unitsize;
+	uint64_t received_samples;
+	int triggered;
+	int ended;
+	struct timeval starttime;
+	uint64_t samplerate;
+	/* Filtered samples not merged yet, when merging */
+	GByteArray *pending;
+	/* Samples to throw away before the other devices started */
+	uint64_t skip;
+};
+
+/*
+ * With more than one device in the session, their samples are lined up by
+ * start time and combined into the units of one merged device, which is
+ * what the outputs get to see.
+ */
+struct merge {
+	/* Stands in for all devices towards the outputs */
+	struct device *device;
+	int unitsize;
+	/* States of the session's devices, in session order */
+	struct device_state **states;
+	int num_states;
+	/* Microseconds between the first and the last device starting */
+	uint64_t skew;
+};
+
+/* State of the acquisition as a whole */
+static int num_started = 0;
+static int num_ended = 0;
+static int outputs_started = FALSE;
+static int acquisition_failed = FALSE;
+static struct merge merge;
+
+static void output_write(struct cli_output *co, char *buf, uint64_t len)
+{
+	if (fwrite(buf, 1, len, co->fp) != len)
+		g_warning("Failed to write to %s: %s",
+			  co->filename ? co->filename : "stdout",
+			  strerror(errno));
+}
+
+static void outputs_init(struct device *device)
+{
+	struct output *o;
+	GSList *l;
+
+	for (l = cli_outputs; l; l = l->next) {
+		o = &((struct cli_output *)l->data)->o;
+		o->device = device;
+		o->internal = NULL;
+		/* TODO: Error handling. */
+		if (o->format->init) {
+			if (o->format->init(o) != SIGROK_OK) {
+				g_error("Output format init failed.");
+				return; /* FIXME */
+			}
+		}
+	}
+	outputs_started = TRUE;
+}
+
+static void outputs_event(int event_type)
+{
+	struct cli_output *co;
+	GSList *l;
+	uint64_t output_len;
+	char *output_buf;
+
+	if (!outputs_started)
+		return;
+
+	for (l = cli_outputs; l; l = l->next) {
+		co = l->data;
+		if (!co->o.format->event)
+			continue;
+		if (event_type != DF_END) {
+			co->o.format->event(&co->o, event_type, 0, 0);
+			continue;
+		}
+		output_len = 0;
+		co->o.format->event(&co->o, DF_END, &output_buf, &output_len);
+		if (output_len) {
+			output_write(co, output_buf, output_len);
+			free(output_buf);
+		}
+		fflush(co->fp);
+	}
+}
+
+/* All outputs are handed the same filtered samples. */
+static void outputs_data(int df_type, char *buf, uint64_t len)
+{
+	struct cli_output *co;
+	GSList *l;
+	uint64_t output_len;
+	char *output_buf;
+
+	if (!outputs_started)
+		return;
+
+	for (l = cli_outputs; l; l = l->next) {
+		co = l->data;
+		if (!co->o.format->data || df_type != co->o.format->df_type)
+			continue;
+		output_len = 0;
+		co->o.format->data(&co->o, buf, len, &output_buf, &output_len);
+		if (output_len) {
+			output_write(co, output_buf, output_len);
+			free(output_buf);
+		}
+	}
+}
+
+static int num_session_devices(void)
+{
+	return g_slist_length(session->devices);
+}
+
+static void device_state_free(gpointer data)
+{
+	struct device_state *ds;
+
+	ds = data;
+	if (ds->filter)
+		filter_destroy(ds->filter);
+	if (ds->pending)
+		g_byte_array_free(ds->pending, TRUE);
+	g_free(ds);
+}
+
+static uint64_t timeval_diff_us(struct timeval *a, struct timeval *b)
+{
+	struct timeval diff;
+
+	timersub(a, b, &diff);
+
+	return diff.tv_sec * (uint64_t)1000000 + diff.tv_usec;
+}
+
+/* Every device sent its header, work out how to line them up. */
+static int merge_start(void)
+{
+	struct device_state *ds;
+	struct probe *probe;
+	struct timeval first, last;
+	GSList *l, *p;
+	uint64_t samplerate;
+	int num_probes, i;
+	char *name;
+
+	merge.num_states = g_slist_length(session->devices);
+	merge.states = g_malloc0(sizeof(struct device_state *)
+				 * merge.num_states);
+	num_probes = 0;
+	for (i = 0, l = session->devices; l; i++, l = l->next) {
+		ds = merge.states[i] = session_device_context_get(l->data);
+		if (i == 0 || timercmp(&ds->starttime, &first, <))
+			first = ds->starttime;
+		if (i == 0 || timercmp(&ds->starttime, &last, >))
+			last = ds->starttime;
+		num_probes += ds->num_enabled_probes;
+	}
+
+	samplerate = merge.states[0]->samplerate;
+	for (i = 1; i < merge.num_states; i++) {
+		if (merge.states[i]->samplerate != samplerate) {
+			printf("Devices don't use the same samplerate, "
+			       "can't merge their samples.\n");
+			return SIGROK_ERR;
+		}
+	}
+	if (num_probes > 64) {
+		printf("Can't merge more than 64 probes.\n");
+		return SIGROK_ERR;
+	}
+
+	/* Samples taken before the last device started are dropped. */
+	merge.skew = timeval_diff_us(&last, &first);
+	for (i = 0; i < merge.num_states; i++) {
+		ds = merge.states[i];
+		ds->skip = timeval_diff_us(&last, &ds->starttime)
+			   * samplerate / 1000000;
+	}
+
+	merge.device = device_new(NULL, 0, 0);
+	for (i = 0, l = session->devices; l; i++, l = l->next) {
+		for (p = ((struct device *)l->data)->probes; p; p = p->next) {
+			probe = p->data;
+			if (!probe->enabled)
+				continue;
+			name = g_strdup_printf("%d:%s", i, probe->name);
+			device_probe_add(merge.device, name);
+			g_free(name);
+		}
+	}
+	merge.unitsize = (num_probes + 7) / 8;
+	outputs_init(merge.device);
+
+	return SIGROK_OK;
+}
+
+static uint64_t unit_value(const uint8_t *unit, int unitsize)
+{
+	uint64_t value;
+	int i;
+
+	value = 0;
+	for (i = 0; i < unitsize; i++)
+		value |= (uint64_t)unit[i] << (i * 8);
+
+	return value;
+}
+
+/* Combine and output the samples every device has sent so far. */
+static void merge_flush(void)
+{
+	struct device_state *ds;
+	uint64_t num_units, n, i, value;
+	int shift, j;
+	uint8_t *out;
+
+	if (!merge.device)
+		return;
+
+	num_units = UINT64_MAX;
+	for (j = 0; j < merge.num_states; j++) {
+		ds = merge.states[j];
+		if (!ds->unitsize)
+			continue;
+		n = ds->pending->len / ds->unitsize;
+		if (ds->skip) {
+			i = MIN(ds->skip, n);
+			g_byte_array_remove_range(ds->pending, 0,
+						  i * ds->unitsize);
+			ds->skip -= i;
+			n -= i;
+		}
+		num_units = MIN(num_units, n);
+	}
+	if (num_units == UINT64_MAX || num_units == 0)
+		return;
+
+	out = g_malloc(num_units * merge.unitsize);
+	for (i = 0; i < num_units; i++) {
+		value = 0;
+		shift = 0;
+		for (j = 0; j < merge.num_states; j++) {
+			ds = merge.states[j];
+			if (!ds->unitsize)
+				continue;
+			value |= unit_value(ds->pending->data
+					    + i * ds->unitsize,
+					    ds->unitsize) << shift;
+			shift += ds->num_enabled_probes;
+		}
+		for (j = 0; j < merge.unitsize; j++)
+			out[i * merge.unitsize + j] = value >> (j * 8);
+	}
+	for (j = 0; j < merge.num_states; j++) {
+		ds = merge.states[j];
+		if (ds->unitsize)
+			g_byte_array_remove_range(ds->pending, 0,
+						  num_units * ds->unitsize);
+	}
+
+	outputs_data(DF_LOGIC, (char *)out, num_units * merge.unitsize);
+	g_free(out);
+}
+
+/* All devices are done. */
+static void acquisition_end(void)
+{
+	int i;
+
+	merge_flush();
+	outputs_event(DF_END);
+
+	if (merge.states) {
+		for (i = 0; i < merge.num_states; i++)
+			printf("Device %d sent %" PRIu64 " samples.\n", i,
+			       merge.states[i]->received_samples);
+		printf("Devices started %" PRIu64 " us apart.\n",
+		       merge.skew);
+		if (merge.device)
+			device_destroy(merge.device);
+		g_free(merge.states);
+	}
+	memset(&merge, 0, sizeof(struct merge));
+	num_started = num_ended = 0;
+	outputs_started = FALSE;
+	if (session)
+		session_halt(session);
+}
+
 void datafeed_in(struct device *device, struct datafeed_packet *packet)
 {
-	static struct output *o = NULL;
-	static int probelist[65] = { 0 };
-	static uint64_t received_samples = 0;
-	static int unitsize = 0;
-	static int triggered = 0;
+	struct device_state *ds;
 	struct probe *probe;
 	struct datafeed_header *header;
-	int num_enabled_probes, sample_size, ret, i;
-	uint64_t output_len, filter_out_len, len, dec_out_size;
-	char *output_buf, *filter_out;
-	uint8_t *dec_out;
+	int num_enabled_probes, sample_size, out_unitsize, ret, i;
+	struct datafeed_pd *pd;
+	uint64_t filter_out_len, len;
+	char *filter_out;
+
+	ds = session_device_context_get(device);
 
 	/* If the first packet to come in isn't a header, don't even try. */
-	if (packet->type != DF_HEADER && o == NULL)
+	if (packet->type != DF_HEADER && !ds)
 		return;
 
 	sample_size = -1;
 
 	switch (packet->type) {
 	case DF_HEADER:
-		/* initialize the output module. */
-		if (!(o = malloc(sizeof(struct output))))
-			return; /* FIXME: How to report errors? */
-		o->format = output_format;
-		o->device = device;
-		o->param = output_format_param;
-
-		/* TODO: Error handling. */
-		if (o->format->init) {
-			if ((ret = o->format->init(o)) != SIGROK_OK) {
-				g_error("Output format init failed.");
-				// return ret;
-				return; /* FIXME */
-			}
-		}
-
+		ds = g_malloc0(sizeof(struct device_state));
+		ds->num = MAX(g_slist_index(session->devices, device), 0);
 		header = (struct datafeed_header *)packet->payload;
 		num_enabled_probes = 0;
 		for (i = 0; i < header->num_logic_probes; i++) {
 			probe = g_slist_nth_data(device->probes, i);
 			if (probe->enabled)
-				probelist[num_enabled_probes++] = probe->index;
+				ds->probelist[num_enabled_probes++] =
+				    probe->index;
 		}
+		ds->num_enabled_probes = num_enabled_probes;
 		/* How many bytes we need to store num_enabled_probes bits? */
-		unitsize = (num_enabled_probes + 7) / 8;
+		ds->unitsize = (num_enabled_probes + 7) / 8;
+		ds->starttime = header->starttime;
+		ds->samplerate = header->samplerate;
+		session_device_context_set(device, ds, device_state_free);
 
 		/*
 		 * Saving sessions will need a datastore to dump into
 		 * the session file.
 		 */
 		if (opt_save_filename) {
-			ret = datastore_new(unitsize, &(device->datastore));
+			ret = datastore_new(ds->unitsize, datastore_flags,
+					    &(device->datastore));
 			if (ret != SIGROK_OK) {
 				g_error("Couldn't create datastore.");
 				/* TODO: free()? */
@@ -331,35 +632,48 @@ void datafeed_in(struct device *device, struct datafeed_packet *packet)
 				return; /* FIXME */
 			}
 		}
+
+		/* initialize the output modules. */
+		if (num_session_devices() == 1) {
+			outputs_init(device);
+		} else {
+			ds->pending = g_byte_array_new();
+			if (++num_started == num_session_devices()
+			    && merge_start() != SIGROK_OK) {
+				/* Nothing would be written, so stop here. */
+				acquisition_failed = TRUE;
+				session_halt(session);
+			}
+		}
 		break;
 	case DF_END:
 		g_message("Received DF_END");
-		if (end_acquisition) {
+		if (ds->ended) {
 			g_message("double end!");
 			break;
 		}
-		if (o->format->event) {
-			o->format->event(o, DF_END, &output_buf, &output_len);
-			if (output_len) {
-				fwrite(output_buf, 1, output_len, stdout);
-				free(output_buf);
-				output_len = 0;
-			}
-		}
-		if (limit_samples && received_samples < limit_samples)
+		ds->ended = TRUE;
+		if (limit_samples && ds->received_samples < limit_samples)
 			printf("Device only sent %" PRIu64 " samples.\n",
-			       received_samples);
+			       ds->received_samples);
 		if (opt_continuous)
 			printf("Device stopped after %" PRIu64 " samples.\n",
-			       received_samples);
-		end_acquisition = TRUE;
-		free(o);
-		o = NULL;
+			       ds->received_samples);
+		if (ds->filter) {
+			filter_destroy(ds->filter);
+			ds->filter = NULL;
+		}
+		if (++num_ended == num_session_devices())
+			acquisition_end();
 		break;
 	case DF_TRIGGER:
-		if (o->format->event)
-			o->format->event(o, DF_TRIGGER, 0, 0);
-		triggered = 1;
+		outputs_event(DF_TRIGGER);
+		ds->triggered = 1;
+		break;
+	case DF_PD:
+		pd = packet->payload;
+		printf("Protocol decoder output:\n%.*s\n", (int)pd->length,
+		       (char *)pd->data);
 		break;
 	case DF_LOGIC:
 	case DF_ANALOG:
@@ -367,130 +681,188 @@ void datafeed_in(struct device *device, struct datafeed_packet *packet)
 		break;
 	}
 
-	if (sample_size == -1)
+	if (sample_size == -1 || ds->ended)
 		return;
 
-	/* Don't store any samples until triggered. */
-	if (opt_wait_trigger && !triggered)
+	/*
+	 * Don't store any samples until triggered. With a pre-trigger, the
+	 * session does the waiting and the samples before it are wanted.
+	 */
+	if (opt_wait_trigger && !opt_pretrigger && !ds->triggered)
 		return;
 
-	if (limit_samples && received_samples >= limit_samples)
+	if (limit_samples && ds->received_samples >= limit_samples)
 		return;
 
 	if (packet->type == DF_LOGIC) {
 		/* filters only support DF_LOGIC */
-		ret = filter_probes(sample_size, unitsize, probelist,
-				  packet->payload, packet->length,
-				  &filter_out, &filter_out_len);
+		if (!ds->filter || ds->filter->in_unitsize != sample_size) {
+			/* The probe mapping is only worked out once. */
+			if (ds->filter)
+				filter_destroy(ds->filter);
+			ds->filter = NULL;
+			if (filter_new(sample_size, ds->unitsize,
+				       ds->probelist, &ds->filter) != SIGROK_OK)
+				return;
+		}
+		ret = filter_run(ds->filter, packet->payload, packet->length,
+				 &filter_out, &filter_out_len);
 		if (ret != SIGROK_OK)
 			return;
+		out_unitsize = ds->unitsize;
 	} else {
-		if (!(filter_out = malloc(packet->length)))
-			return;
+		filter_out = packet->payload;
 		filter_out_len = packet->length;
+		out_unitsize = sample_size;
 	}
 
 	if (device->datastore)
 		datastore_put(device->datastore, filter_out,
-			      filter_out_len, sample_size, probelist);
-
-	if (current_decoder) {
-		/* TODO: Handle errors. */
-		sigrokdecode_run_decoder(dec, packet->payload, packet->length,
-					 &dec_out, &dec_out_size);
-		printf("Protocol decoder output:\n%s\n", dec_out);
-	}
-
-	/* Don't dump samples on stdout when also saving the session. */
-	output_len = 0;
-	if (!opt_save_filename) {
-		if (o->format->data && packet->type == o->format->df_type) {
-			if (limit_samples
-					&& received_samples + packet->length / sample_size > limit_samples * sample_size)
-				len = limit_samples * sample_size - received_samples;
-			else
-				len = filter_out_len;
-			o->format->data(o, filter_out, len, &output_buf, &output_len);
-		}
-		if (output_len)
-			fwrite(output_buf, 1, output_len, stdout);
+			      filter_out_len, sample_size, ds->probelist);
+
+	len = filter_out_len;
+	if (limit_samples && out_unitsize && ds->received_samples
+	    + len / out_unitsize > limit_samples)
+		len = (limit_samples - ds->received_samples) * out_unitsize;
+
+	if (!ds->pending) {
+		outputs_data(packet->type, filter_out, len);
+	} else if (packet->type == DF_LOGIC) {
+		/* Only logic samples are merged. */
+		g_byte_array_append(ds->pending, (guint8 *)filter_out, len);
+		merge_flush();
 	}
-	free(filter_out);
-	if (output_len)
-		free(output_buf);
-	received_samples += packet->length / sample_size;
+
+	ds->received_samples += packet->length / sample_size;
 }
 
-void remove_source(int fd)
-{
-	struct source *new_sources;
-	int old, new;
+/* A protocol decoder, with a decoder instance per device it decodes. */
+struct cli_pd {
+	struct sigrokdecode_decoder *dec;
+	/* struct device* -> struct cli_pd_stream* */
+	GHashTable *streams;
+};
 
-	if (!sources)
-		return;
+struct cli_pd_stream {
+	struct sigrokdecode_decoder_instance *di;
+	/* Samples fed so far */
+	uint64_t samplenum;
+};
 
-	new_sources = calloc(1, sizeof(struct source) * num_sources);
-	for (old = 0; old < num_sources; old++)
-		if (sources[old].fd != fd)
-			memcpy(&new_sources[new++], &sources[old],
-			       sizeof(struct source));
+static void pd_stream_free(gpointer data)
+{
+	struct cli_pd_stream *stream;
 
-	if (old != new) {
-		free(sources);
-		sources = new_sources;
-		num_sources--;
-	} else {
-		/* Target fd was not found. */
-		free(new_sources);
-	}
+	stream = data;
+	sigrokdecode_decoder_destroy_instance(stream->di);
+	g_free(stream);
 }
 
-void add_source(int fd, int events, int timeout, receive_data_callback callback,
-		void *user_data)
+/*
+ * Runs in the session's analyzer thread. Nothing else uses Python while
+ * the session runs. Every acquisition gets a new decoder instance, which
+ * is fed the samples as they come in and stays around until the next one,
+ * as its output does.
+ */
+static int run_pd(struct analyzer *an, struct device *device,
+		  struct datafeed_packet *packet, uint8_t **out,
+		  uint64_t *out_len)
 {
-	struct source *new_sources, *s;
+	struct cli_pd *pd;
+	struct cli_pd_stream *stream;
+	int ret;
 
-	new_sources = calloc(1, sizeof(struct source) * (num_sources + 1));
+	pd = an->internal;
+	stream = g_hash_table_lookup(pd->streams, device);
 
-	if (sources) {
-		memcpy(new_sources, sources, sizeof(struct source) * num_sources);
-		free(sources);
+	switch (packet->type) {
+	case DF_HEADER:
+		stream = g_malloc0(sizeof(struct cli_pd_stream));
+		if (sigrokdecode_decoder_new_instance(pd->dec, &stream->di)
+		    != SIGROKDECODE_OK) {
+			g_free(stream);
+			g_hash_table_remove(pd->streams, device);
+			return SIGROK_ERR;
+		}
+		g_hash_table_insert(pd->streams, device, stream);
+		return SIGROK_OK;
+	case DF_LOGIC:
+		if (!stream || !packet->unitsize)
+			return SIGROK_OK;
+		ret = sigrokdecode_decoder_feed(stream->di, packet->payload,
+				packet->length, packet->unitsize,
+				stream->samplenum, out, out_len);
+		stream->samplenum += packet->length / packet->unitsize;
+		break;
+	case DF_END:
+		if (!stream)
+			return SIGROK_OK;
+		ret = sigrokdecode_decoder_end(stream->di, out, out_len);
+		break;
+	default:
+		return SIGROK_OK;
 	}
 
-	s = &new_sources[num_sources++];
-	s->fd = fd;
-	s->events = events;
-	s->timeout = timeout;
-	s->cb = callback;
-	s->user_data = user_data;
-	sources = new_sources;
-
-	if (timeout != source_timeout && timeout > 0
-	    && (source_timeout == -1 || timeout < source_timeout))
-		source_timeout = timeout;
+	return ret == SIGROKDECODE_OK ? SIGROK_OK : SIGROK_ERR;
 }
 
-/* Register the given PDs for this session. */
+/* Register the given PDs, to be added to the session later. */
 /* TODO: Support both serial PDs and nested PDs. Parallel PDs even? */
-/* TODO: Only register here, run in streaming fashion later/elsewhere. */
 static int register_pds(struct device *device, const char *pdstring)
 {
+	struct sigrokdecode_decoder *dec;
+	struct analyzer *an;
+	struct cli_pd *pd;
 	char **tokens;
+	int i;
 
 	/* Avoid compiler warnings. */
 	device = device;
 
 	tokens = g_strsplit(pdstring, ",", 10 /* FIXME */);
 
-	if (tokens[0] && strlen(tokens[0]) > 0) {
-		current_decoder = tokens[0];
-		/* TODO: Handle errors. */
-		sigrokdecode_load_decoder(current_decoder, &dec);
+	for (i = 0; tokens[i]; i++) {
+		if (strlen(tokens[i]) == 0)
+			continue;
+		if (sigrokdecode_load_decoder(tokens[i], &dec)
+		    != SIGROKDECODE_OK) {
+			g_warning("Failed to load protocol decoder %s.",
+				  tokens[i]);
+			continue;
+		}
+		pd = g_malloc0(sizeof(struct cli_pd));
+		pd->dec = dec;
+		pd->streams = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, pd_stream_free);
+		an = g_malloc0(sizeof(struct analyzer));
+		an->name = g_strdup(tokens[i]);
+		an->decode = run_pd;
+		an->internal = pd;
+		analyzers = g_slist_append(analyzers, an);
 	}
+	g_strfreev(tokens);
 
 	return 0;
 }
 
+static void free_pds(void)
+{
+	struct analyzer *an;
+	struct cli_pd *pd;
+	GSList *l;
+
+	for (l = analyzers; l; l = l->next) {
+		an = l->data;
+		pd = an->internal;
+		g_hash_table_destroy(pd->streams);
+		g_free(pd);
+		g_free(an->name);
+		g_free(an);
+	}
+	g_slist_free(analyzers);
+	analyzers = NULL;
+}
+
 void select_probes(struct device *device)
 {
 	struct probe *probe;
@@ -504,10 +876,8 @@ void select_probes(struct device *device)
 		 */
 		max_probes = g_slist_length(device->probes);
 		probelist = parse_probestring(max_probes, opt_probes);
-		if (!probelist) {
-			session_destroy();
+		if (!probelist)
 			return;
-		}
 
 		for (i = 0; i < max_probes; i++) {
 			if (probelist[i]) {
@@ -522,6 +892,30 @@ void select_probes(struct device *device)
 	}
 }
 
+/*
+ * Put the protocol decoders on the session's bus, and hand packets to
+ * datafeed_in() from a thread of its own, with --bus. With --pre-trigger,
+ * the session holds back samples until the trigger.
+ */
+static void setup_bus(void)
+{
+	GSList *l;
+
+	for (l = analyzers; l; l = l->next)
+		session_pa_add(session, l->data);
+
+	if (opt_pretrigger)
+		session_pretrigger_set(session,
+				       parse_sizestring(opt_pretrigger));
+
+	if (bus_policy < 0)
+		return;
+
+	if (session_bus_threaded(session, BUS_QUEUE_LEN, bus_policy)
+	    != SIGROK_OK)
+		g_warning("Couldn't set up threaded bus, not using it.");
+}
+
 void load_input_file(void)
 {
 	struct stat st;
@@ -563,17 +957,43 @@ void load_input_file(void)
 
 	select_probes(in->vdevice);
 
-	session_new();
-	session_datafeed_callback_add(datafeed_in);
+	if (!(session = session_new())) {
+		g_warning("Failed to create session.");
+		return;
+	}
+	session_datafeed_callback_add(session, datafeed_in);
+	setup_bus();
+	session_device_add(session, in->vdevice);
 	input_format->loadfile(in, opt_input_file);
-	session_stop();
+	session_stop(session);
+	session_destroy(session);
 }
 
-void load_session_file(void)
+int load_session_file(void)
 {
+	if (!(session = session_load(opt_load_filename))) {
+		printf("Failed to load session file.\n");
+		return SIGROK_ERR;
+	}
+
+	session_datafeed_callback_add(session, datafeed_in);
+	setup_bus();
+
+	if (session_start(session) != SIGROK_OK) {
+		printf("Failed to start session.\n");
+		session_destroy(session);
+		return SIGROK_ERR;
+	}
+
+	session_run(session);
 
-	/* TODO: not yet implemented */
+	session_stop(session);
+	if (opt_save_filename)
+		if (session_save(session, opt_save_filename) != SIGROK_OK)
+			printf("Failed to save session.\n");
+	session_destroy(session);
 
+	return acquisition_failed ? SIGROK_ERR : SIGROK_OK;
 }
 
 int num_real_devices(void)
@@ -685,9 +1105,15 @@ static int handle_triggerstring(struct device *device, char *string)
 			return ret;
 
 		trigger_type = str_to_triggertype(tokens[0]);
-		arg = g_strsplit(tokens[1], ":", MAX_TRIGGER_ARGS);
+		/* A protocol trigger's pattern may contain colons. */
+		arg = g_strsplit(tokens[1], ":",
+				 trigger_type == TRIGGER_TYPE_PROTO
+				 ? 2 : MAX_TRIGGER_ARGS);
 		numargs = g_strv_length(arg);
-		t = device_trigger_add(device, trigger_type, numargs);
+		if (!(t = device_trigger_add(device, trigger_type, numargs))) {
+			printf("Unknown trigger type '%s'.\n", tokens[0]);
+			return SIGROK_ERR;
+		}
 
 		switch (trigger_type) {
 		case TRIGGER_TYPE_LOGIC:
@@ -703,26 +1129,59 @@ static int handle_triggerstring(struct device *device, char *string)
 					return ret;
 			}
 			break;
+		/* The voltage is optional, logic probes don't need it. */
 		case TRIGGER_TYPE_EDGE:
+			if (numargs < 2)
+				return SIGROK_ERR;
 			t->edge->probe = probe_find(device, atoi(arg[0]));
 			t->edge->direction = str_to_triggerdirection(arg[1]);
-			t->edge->voltage = strtod(arg[2], NULL);
+			if (numargs > 2)
+				t->edge->voltage = strtod(arg[2], NULL);
 			break;
 		case TRIGGER_TYPE_WIDTH:
+			if (numargs < 4)
+				return SIGROK_ERR;
 			t->width->probe = probe_find(device, atoi(arg[0]));
 			t->width->direction = str_to_triggerdirection(arg[1]);
 			t->width->mol = str_to_triggermol(arg[2]);
-			t->width->psecs = strtoul(arg[3], NULL, 10);
-			t->width->voltage = strtod(arg[4], NULL);
+			t->width->psecs = strtoull(arg[3], NULL, 10);
+			if (numargs > 4)
+				t->width->voltage = strtod(arg[4], NULL);
+			break;
 		case TRIGGER_TYPE_COUNT:
+			if (numargs < 2)
+				return SIGROK_ERR;
 			t->count->probe = probe_find(device, atoi(arg[0]));
 			t->count->count = atoi(arg[1]);
-			t->count->voltage = strtod(arg[2], NULL);
-
-		/* FIXME: Implement other trigger types */
+			if (numargs > 2)
+				t->count->voltage = strtod(arg[2], NULL);
+			break;
+		/*
+		 * serial=<probe>:<clock>:<bits>:<value>[:<mask>], where the
+		 * clock is a clock probe, or a bit rate such as "115200bps".
+		 */
 		case TRIGGER_TYPE_SERIAL:
+			if (numargs < 4)
+				return SIGROK_ERR;
+			t->serial->probe = probe_find(device, atoi(arg[0]));
+			if (g_str_has_suffix(arg[1], "bps")) {
+				arg[1][strlen(arg[1]) - 3] = '\0';
+				t->serial->clock = parse_sizestring(arg[1]);
+			} else {
+				t->serial->clock_source = atoi(arg[1]);
+			}
+			t->serial->n = atoi(arg[2]);
+			t->serial->value = strtoull(arg[3], NULL, 0);
+			if (numargs > 4)
+				t->serial->mask = strtoull(arg[4], NULL, 0);
+			break;
+		/* proto=<decoder>:<pattern> */
 		case TRIGGER_TYPE_PROTO:
-			return SIGROK_ERR;
+			if (numargs < 2)
+				return SIGROK_ERR;
+			t->proto->analyzer = g_strdup(arg[0]);
+			t->proto->pattern = g_strdup(arg[1]);
+			break;
 		}
 	}
 
@@ -774,70 +1233,28 @@ static int handle_triggerstring(struct device *device, char *string)
 	return SIGROK_OK;
 }
 
-void run_session(void)
+/* Apply the command line's device settings to a device in the session. */
+static int setup_device(struct device *device)
 {
-	struct device *device;
-	GPollFD *fds;
-	int num_devices, max_probes, *capabilities, ret, found, i, j;
+	int *capabilities, ret, found, i, j;
 	unsigned int time_msec;
 	uint64_t tmp_u64;
-	char **probelist, *val;
-
-	device_scan();
-	num_devices = num_real_devices();
-
-	if (!opt_device && num_devices == 0) {
-		g_warning("No devices found.");
-		return;
-	}
-
-	if (!opt_device) {
-		if (num_devices == 1)
-			/* No device specified, but there is only one. */
-			device = parse_devicestring("0");
-		else {
-			g_warning("%d devices found, please select one.", num_devices);
-			return;
-		}
-	} else {
-		device = parse_devicestring(opt_device);
-		if (!device) {
-			g_warning("Device not found.");
-			return;
-		}
-	}
-	select_probes(device);
-
-	if (opt_continuous) {
-		capabilities = device->plugin->get_capabilities();
-		if (!find_hwcap(capabilities, HWCAP_CONTINUOUS)) {
-			g_warning("This device does not support continuous sampling.");
-			return;
-		}
-	}
-
-	session_new();
-	session_datafeed_callback_add(datafeed_in);
-	source_cb_remove = remove_source;
-	source_cb_add = add_source;
-
-	if (session_device_add(device) != SIGROK_OK) {
-		printf("Failed to use device.\n");
-		session_destroy();
-		return;
-	}
+	char *val;
+	struct trigger *t;
+	GSList *l, *hw_triggers;
 
 	if (opt_triggers) {
-		handle_triggerstring(device, opt_triggers);
-//		exit(1);
+		if (handle_triggerstring(device, opt_triggers) != SIGROK_OK) {
+			printf("Invalid trigger '%s'.\n", opt_triggers);
+			return SIGROK_ERR;
+		}
 	}
 
 	if (opt_devoption) {
 		for (i = 0; opt_devoption[i]; i++) {
 			if (!(val = strchr(opt_devoption[i], '='))) {
 				printf("No value given for device option '%s'.\n", opt_devoption[i]);
-				session_destroy();
-				return;
+				return SIGROK_ERR;
 			}
 
 			found = FALSE;
@@ -861,8 +1278,7 @@ void run_session(void)
 
 					if (ret != SIGROK_OK) {
 						printf("Failed to set device option '%s'.\n", opt_devoption[i]);
-						session_destroy();
-						return;
+						return SIGROK_ERR;
 					}
 					else
 						break;
@@ -871,9 +1287,10 @@ void run_session(void)
 			if (!found) {
 				printf("Unknown device option '%s'.\n",
 				       opt_devoption[i]);
-				session_destroy();
-				return;
+				return SIGROK_ERR;
 			}
+			/* Other devices get the same options. */
+			val[-1] = '=';
 		}
 	}
 
@@ -905,63 +1322,179 @@ void run_session(void)
 	if (device->plugin->set_configuration(device->plugin_index,
 		  HWCAP_PROBECONFIG, (char *)device->probes) != SIGROK_OK) {
 		printf("Failed to configure probes.\n");
-		session_destroy();
-		return;
+		return SIGROK_ERR;
 	}
 
-	if (device->plugin->set_configuration(device->plugin_index,
-		 HWCAP_TRIGGERCONFIG, (char *)device->triggers) != SIGROK_OK) {
+	/* Triggers the driver can't handle are run by the session. */
+	hw_triggers = NULL;
+	for (l = device->triggers; l; l = l->next) {
+		t = l->data;
+		if (device_trigger_supported(device, t->type))
+			hw_triggers = g_slist_append(hw_triggers, t);
+	}
+	ret = device->plugin->set_configuration(device->plugin_index,
+				HWCAP_TRIGGERCONFIG, (char *)hw_triggers);
+	g_slist_free(hw_triggers);
+	if (ret != SIGROK_OK) {
 		printf("Failed to configure triggers.\n");
-		session_destroy();
-		return;
+		return SIGROK_ERR;
 	}
 
-	if (session_start() != SIGROK_OK) {
-		printf("Failed to start session.\n");
-		session_destroy();
-		return;
+	return SIGROK_OK;
+}
+
+/*
+ * The samples of several devices are merged into one stream, which needs
+ * a common samplerate and no more than 64 probes between them. Check that
+ * before starting, rather than finding out when the headers come in.
+ */
+static int check_merge(GSList *devices)
+{
+	struct device *device;
+	struct probe *probe;
+	GSList *l, *p;
+	uint64_t samplerate, *cur_samplerate;
+	int num_probes;
+
+	if (!devices || !devices->next)
+		return SIGROK_OK;
+
+	samplerate = 0;
+	num_probes = 0;
+	for (l = devices; l; l = l->next) {
+		device = l->data;
+		for (p = device->probes; p; p = p->next) {
+			probe = p->data;
+			if (probe->enabled)
+				num_probes++;
+		}
+
+		cur_samplerate = device->plugin->get_device_info(
+				device->plugin_index, DI_CUR_SAMPLERATE);
+		if (!cur_samplerate)
+			continue;
+		if (samplerate && *cur_samplerate != samplerate) {
+			printf("Devices don't use the same samplerate, "
+			       "can't merge their samples.\n");
+			return SIGROK_ERR;
+		}
+		samplerate = *cur_samplerate;
 	}
 
-	if (opt_continuous)
-		add_anykey();
-
-	fds = NULL;
-	while (!end_acquisition) {
-		if (fds)
-			free(fds);
-
-		/* Construct g_poll()'s array. */
-		fds = malloc(sizeof(GPollFD) * num_sources);
-		for (i = 0; i < num_sources; i++) {
-			fds[i].fd = sources[i].fd;
-			fds[i].events = sources[i].events;
+	if (num_probes > 64) {
+		printf("Can't merge more than 64 probes.\n");
+		return SIGROK_ERR;
+	}
+
+	return SIGROK_OK;
+}
+
+int run_session(void)
+{
+	struct device *device;
+	GSList *devices, *l;
+	int num_devices, *capabilities, i;
+	char **devicestrings;
+
+	device_scan();
+	num_devices = num_real_devices();
+
+	if (!opt_device && num_devices == 0) {
+		g_warning("No devices found.");
+		return SIGROK_ERR;
+	}
+
+	devices = NULL;
+	if (!opt_device) {
+		if (num_devices == 1)
+			/* No device specified, but there is only one. */
+			devices = g_slist_append(devices,
+						 parse_devicestring("0"));
+		else {
+			g_warning("%d devices found, please select one.", num_devices);
+			return SIGROK_ERR;
 		}
+	} else {
+		/* Several devices can be given, separated by commas. */
+		devicestrings = g_strsplit(opt_device, ",", 0);
+		for (i = 0; devicestrings[i]; i++) {
+			device = parse_devicestring(devicestrings[i]);
+			if (!device) {
+				g_warning("Device %s not found.",
+					  devicestrings[i]);
+				g_strfreev(devicestrings);
+				g_slist_free(devices);
+				return SIGROK_ERR;
+			}
+			devices = g_slist_append(devices, device);
+		}
+		g_strfreev(devicestrings);
+	}
 
-		ret = g_poll(fds, num_sources, source_timeout);
-
-		for (i = 0; i < num_sources; i++) {
-			if (fds[i].revents > 0 || (ret == 0
-				&& source_timeout == sources[i].timeout)) {
-				/*
-				 * Invoke the source's callback on an event,
-				 * or if the poll timeout out and this source
-				 * asked for that timeout.
-				 */
-				sources[i].cb(fds[i].fd, fds[i].revents,
-					      sources[i].user_data);
+	for (l = devices; l; l = l->next) {
+		device = l->data;
+		select_probes(device);
+
+		if (opt_continuous) {
+			capabilities = device->plugin->get_capabilities();
+			if (!find_hwcap(capabilities, HWCAP_CONTINUOUS)) {
+				g_warning("This device does not support continuous sampling.");
+				g_slist_free(devices);
+				return SIGROK_ERR;
 			}
 		}
 	}
-	free(fds);
+
+	if (!(session = session_new())) {
+		g_warning("Failed to create session.");
+		g_slist_free(devices);
+		return SIGROK_ERR;
+	}
+	session_datafeed_callback_add(session, datafeed_in);
+	setup_bus();
+
+	for (l = devices; l; l = l->next) {
+		device = l->data;
+		if (session_device_add(session, device) != SIGROK_OK) {
+			printf("Failed to use device.\n");
+			g_slist_free(devices);
+			session_destroy(session);
+			return SIGROK_ERR;
+		}
+		if (setup_device(device) != SIGROK_OK) {
+			g_slist_free(devices);
+			session_destroy(session);
+			return SIGROK_ERR;
+		}
+	}
+	if (check_merge(devices) != SIGROK_OK) {
+		g_slist_free(devices);
+		session_destroy(session);
+		return SIGROK_ERR;
+	}
+	g_slist_free(devices);
+
+	if (session_start(session) != SIGROK_OK) {
+		printf("Failed to start session.\n");
+		session_destroy(session);
+		return SIGROK_ERR;
+	}
+
+	if (opt_continuous)
+		add_anykey(session);
+
+	session_run(session);
 
 	if (opt_continuous)
 		clear_anykey();
 
-	session_stop();
+	session_stop(session);
 	if (opt_save_filename)
-		if (session_save(opt_save_filename) != SIGROK_OK)
+		if (session_save(session, opt_save_filename) != SIGROK_OK)
 			printf("Failed to save session.\n");
-	session_destroy();
+	session_destroy(session);
+
+	return acquisition_failed ? SIGROK_ERR : SIGROK_OK;
 }
 
 void logger(const gchar *log_domain, GLogLevelFlags log_level,
@@ -987,16 +1520,79 @@ void logger(const gchar *log_domain, GLogLevelFlags log_level,
 	}
 }
 
-int main(int argc, char **argv)
+/*
+ * Set up an output from a --format argument: the format name with its
+ * parameter, optionally followed by '=' and the file to write to.
+ */
+static int add_output(const char *formatstring)
 {
-	struct output_format **outputs;
+	struct output_format **formats;
+	struct cli_output *co;
+	char **tokens;
 	int i;
+
+	tokens = g_strsplit(formatstring, "=", 2);
+	co = g_malloc0(sizeof(struct cli_output));
+	formats = output_list();
+	for (i = 0; formats[i]; i++) {
+		if (!strncasecmp(formats[i]->extension, tokens[0],
+		     strlen(formats[i]->extension))) {
+			co->o.format = formats[i];
+			co->o.param = g_strdup(tokens[0]
+					       + strlen(formats[i]->extension));
+			break;
+		}
+	}
+	if (!co->o.format) {
+		printf("invalid output format %s\n", tokens[0]);
+		g_strfreev(tokens);
+		g_free(co);
+		return SIGROK_ERR;
+	}
+
+	if (tokens[1] && strcmp(tokens[1], "-")) {
+		co->filename = g_strdup(tokens[1]);
+		if (!(co->fp = fopen(co->filename, "wb"))) {
+			printf("Failed to open %s: %s\n", co->filename,
+			       strerror(errno));
+			g_strfreev(tokens);
+			g_free(co->o.param);
+			g_free(co->filename);
+			g_free(co);
+			return SIGROK_ERR;
+		}
+	} else {
+		co->fp = stdout;
+	}
+	g_strfreev(tokens);
+	cli_outputs = g_slist_append(cli_outputs, co);
+
+	return SIGROK_OK;
+}
+
+static void close_outputs(void)
+{
+	struct cli_output *co;
+	GSList *l;
+
+	for (l = cli_outputs; l; l = l->next) {
+		co = l->data;
+		if (co->fp != stdout)
+			fclose(co->fp);
+		g_free(co->filename);
+		g_free(co->o.param);
+		g_free(co);
+	}
+	g_slist_free(cli_outputs);
+	cli_outputs = NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int ret, i;
 	GOptionContext *context;
 	GError *error;
 
-	/* No decoder at the moment. */
-	current_decoder = NULL;
-
 	g_log_set_default_handler(logger, NULL);
 	if (getenv("SIGROK_DEBUG"))
 		debug = strtol(getenv("SIGROK_DEBUG"), NULL, 10);
@@ -1019,23 +1615,44 @@ int main(int argc, char **argv)
 		register_pds(NULL, opt_pds);
 	}
 
-	if (!opt_format)
-		opt_format = DEFAULT_OUTPUT_FORMAT;
-	outputs = output_list();
-	for (i = 0; outputs[i]; i++) {
-		if (!strncasecmp(outputs[i]->extension, opt_format,
-		     strlen(outputs[i]->extension))) {
-			output_format = outputs[i];
-			output_format_param =
-			    opt_format + strlen(outputs[i]->extension);
-			break;
+	/*
+	 * Don't dump samples on stdout when saving the session, unless
+	 * an output was asked for explicitly.
+	 */
+	if (!opt_formats && !opt_save_filename) {
+		if (add_output(DEFAULT_OUTPUT_FORMAT) != SIGROK_OK)
+			return 1;
+	}
+	for (i = 0; opt_formats && opt_formats[i]; i++) {
+		if (add_output(opt_formats[i]) != SIGROK_OK)
+			return 1;
+	}
+
+	if (opt_datastore) {
+		if (!strcasecmp(opt_datastore, "mmap")) {
+			datastore_flags |= DATASTORE_MMAP;
+		} else if (!strcasecmp(opt_datastore, "rle")) {
+			datastore_flags |= DATASTORE_RLE;
+		} else if (strcasecmp(opt_datastore, "memory")) {
+			printf("invalid datastore type %s\n", opt_datastore);
+			return 1;
 		}
 	}
-	if (!output_format) {
-		printf("invalid output format %s\n", opt_format);
-		return 1;
+
+	if (opt_bus) {
+		if (!strcasecmp(opt_bus, "block")) {
+			bus_policy = BUS_QUEUE_BLOCK;
+		} else if (!strcasecmp(opt_bus, "drop-oldest")) {
+			bus_policy = BUS_QUEUE_DROP_OLDEST;
+		} else if (!strcasecmp(opt_bus, "drop")) {
+			bus_policy = BUS_QUEUE_DROP_NEWEST;
+		} else {
+			printf("invalid bus policy %s\n", opt_bus);
+			return 1;
+		}
 	}
 
+	ret = SIGROK_OK;
 	if (opt_version)
 		show_version();
 	else if (opt_list_devices)
@@ -1043,19 +1660,22 @@ int main(int argc, char **argv)
 	else if (opt_input_file)
 		load_input_file();
 	else if (opt_load_filename)
-		load_session_file();
+		ret = load_session_file();
 	else if (opt_samples || opt_time || opt_continuous)
-		run_session();
+		ret = run_session();
 	else if (opt_device)
 		show_device_detail();
 	else
 		printf("%s", g_option_context_get_help(context, TRUE, NULL));
 
-	if (opt_pds)
+	if (opt_pds) {
+		free_pds();
 		sigrokdecode_shutdown();
+	}
 
+	close_outputs();
 	g_option_context_free(context);
 	sigrok_cleanup();
 
-	return 0;
+	return ret == SIGROK_OK ? 0 : 1;
 }
@@ -23,8 +23,6 @@
 
 /* sigrok-cli.c */
 int num_real_devices(void);
-void add_source(int fd, int events, int timeout, receive_data_callback callback,
-		void *user_data);
 
 /* parsers.c */
 char **parse_probestring(int max_probes, char *probestring);
@@ -33,7 +31,7 @@ uint64_t parse_sizestring(char *sizestring);
 struct device *parse_devicestring(char *devicestring);
 
 /* anykey.c */
-void add_anykey(void);
+void add_anykey(struct session *session);
 void clear_anykey(void);
 
 #endif /* SIGROK_CLI_H_ */
@@ -0,0 +1,169 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2010 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares filter_probes() against filter_new()/filter_run() for every
+ * unitsize, and checks that both produce the same output.
+ *
+ * Build with "make -C contrib filter_bench" and run it without arguments,
+ * or pass the number of MiB of sample data to use (default 4).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include <sigrok.h>
+
+#define ROUNDS 8
+
+static double run_scalar(int in_unitsize, int out_unitsize, int *probelist,
+			 char *data, uint64_t length, char **out,
+			 uint64_t *out_length)
+{
+	GTimer *timer;
+	double elapsed;
+	int i;
+
+	timer = g_timer_new();
+	for (i = 0; i < ROUNDS; i++) {
+		if (i > 0)
+			free(*out);
+		if (filter_probes(in_unitsize, out_unitsize, probelist, data,
+				  length, out, out_length) != SIGROK_OK) {
+			g_timer_destroy(timer);
+			return -1;
+		}
+	}
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	return elapsed;
+}
+
+static double run_filter(struct probe_filter *filter, char *data,
+			 uint64_t length, char **out, uint64_t *out_length)
+{
+	GTimer *timer;
+	double elapsed;
+	int i;
+
+	timer = g_timer_new();
+	for (i = 0; i < ROUNDS; i++) {
+		if (filter_run(filter, data, length, out,
+			       out_length) != SIGROK_OK) {
+			g_timer_destroy(timer);
+			return -1;
+		}
+	}
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	return elapsed;
+}
+
+/* Enables a random, ascending set of about half the probes. */
+static int make_probelist(int unitsize, int *probelist)
+{
+	int probe, num_probes;
+
+	num_probes = 0;
+	for (probe = 1; probe <= unitsize * 8; probe++) {
+		if (g_random_boolean())
+			probelist[num_probes++] = probe;
+	}
+	if (num_probes == 0)
+		probelist[num_probes++] = 1;
+	probelist[num_probes] = 0;
+
+	return num_probes;
+}
+
+int main(int argc, char **argv)
+{
+	struct probe_filter *filter;
+	uint64_t length, i, scalar_length, fast_length, samples;
+	double scalar_time, fast_time;
+	char *data, *scalar_out, *fast_out;
+	int probelist[65], unitsize, out_unitsize, num_probes, failed;
+
+	length = 4;
+	if (argc > 1 && (length = strtoull(argv[1], NULL, 10)) == 0) {
+		fprintf(stderr, "Usage: %s [MiB]\n", argv[0]);
+		return 1;
+	}
+	length *= 1024 * 1024;
+
+	if (!(data = malloc(length))) {
+		fprintf(stderr, "Failed to allocate sample data.\n");
+		return 1;
+	}
+	for (i = 0; i < length; i++)
+		data[i] = g_random_int() & 0xff;
+
+	printf("unitsize  probes  scalar         filter_run     speedup\n");
+	failed = 0;
+	for (unitsize = 1; unitsize <= 8; unitsize++) {
+		num_probes = make_probelist(unitsize, probelist);
+		out_unitsize = (num_probes + 7) / 8;
+		samples = length / unitsize * ROUNDS;
+
+		if (filter_new(unitsize, out_unitsize, probelist,
+			       &filter) != SIGROK_OK) {
+			fprintf(stderr, "filter_new() failed for unitsize "
+				"%d.\n", unitsize);
+			failed = 1;
+			continue;
+		}
+
+		scalar_time = run_scalar(unitsize, out_unitsize, probelist,
+					 data, length, &scalar_out,
+					 &scalar_length);
+		fast_time = run_filter(filter, data, length, &fast_out,
+				       &fast_length);
+		if (scalar_time < 0 || fast_time < 0) {
+			fprintf(stderr, "Filtering failed for unitsize %d.\n",
+				unitsize);
+			filter_destroy(filter);
+			failed = 1;
+			continue;
+		}
+
+		/* filter_probes() keeps any trailing partial sample. */
+		if (scalar_length < fast_length
+		    || memcmp(scalar_out, fast_out, fast_length)) {
+			fprintf(stderr, "Output mismatch for unitsize %d.\n",
+				unitsize);
+			failed = 1;
+		}
+
+		printf("%-8d  %-6d  %7.1f MS/s   %7.1f MS/s   %5.1fx\n",
+		       unitsize, num_probes,
+		       samples / scalar_time / 1000000,
+		       samples / fast_time / 1000000,
+		       scalar_time / fast_time);
+
+		free(scalar_out);
+		filter_destroy(filter);
+	}
+	free(data);
+
+	return failed;
+}
@@ -28,4 +28,5 @@ int sigrok_init(void)
 void sigrok_cleanup(void)
 {
 	device_close_all();
+	packet_buffer_pool_cleanup();
 }
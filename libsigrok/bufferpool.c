@@ -0,0 +1,165 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2011 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <glib.h>
+#include <sigrok.h>
+
+/*
+ * Buffers are pooled in power-of-two size classes from 512 bytes up to
+ * 1 MiB. Anything bigger is allocated and freed every time.
+ */
+#define POOL_MIN_SHIFT		9
+#define POOL_MAX_SHIFT		20
+#define POOL_NUM_CLASSES	(POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+/* Maximum number of unused buffers kept around per size class. */
+#define POOL_MAX_FREE		32
+
+/* Buffers can be released from other threads than the driver's. */
+static GStaticMutex pool_mutex = G_STATIC_MUTEX_INIT;
+static struct packet_buffer *free_buffers[POOL_NUM_CLASSES];
+static int num_free[POOL_NUM_CLASSES];
+
+static int size_class(uint64_t size)
+{
+	int class;
+
+	for (class = 0; class < POOL_NUM_CLASSES; class++) {
+		if (size <= (uint64_t)1 << (class + POOL_MIN_SHIFT))
+			return class;
+	}
+
+	return -1;
+}
+
+/*
+ * Get a buffer of at least size bytes, with a reference count of 1. Drivers
+ * fill buffer->data with samples, point a packet's payload into it and set
+ * the packet's buffer field, so datafeed callbacks can hold on to the data
+ * with packet_buffer_ref() instead of copying it. In the steady state of an
+ * acquisition, buffers are recycled and nothing is allocated.
+ */
+struct packet_buffer *packet_buffer_new(uint64_t size)
+{
+	struct packet_buffer *buf;
+	uint64_t alloc_size;
+	int class;
+
+	buf = NULL;
+	if ((class = size_class(size)) != -1) {
+		g_static_mutex_lock(&pool_mutex);
+		if ((buf = free_buffers[class])) {
+			free_buffers[class] = buf->next;
+			num_free[class]--;
+		}
+		g_static_mutex_unlock(&pool_mutex);
+		alloc_size = (uint64_t)1 << (class + POOL_MIN_SHIFT);
+	} else {
+		alloc_size = size;
+	}
+
+	if (!buf) {
+		buf = g_try_malloc(sizeof(struct packet_buffer) + alloc_size);
+		if (!buf)
+			return NULL;
+		buf->size_class = class;
+		buf->size = alloc_size;
+		/* The samples follow the header, in the same allocation. */
+		buf->data = buf + 1;
+	}
+	buf->refcount = 1;
+	buf->next = NULL;
+
+	return buf;
+}
+
+/* Find the buffer holding data, as returned in packet_buffer->data. */
+struct packet_buffer *packet_buffer_from_data(void *data)
+{
+	return (struct packet_buffer *)data - 1;
+}
+
+void packet_buffer_ref(struct packet_buffer *buf)
+{
+	g_atomic_int_inc(&buf->refcount);
+}
+
+/* Drop a reference, returning the buffer to the pool if it was the last. */
+void packet_buffer_unref(struct packet_buffer *buf)
+{
+	if (!g_atomic_int_dec_and_test(&buf->refcount))
+		return;
+
+	if (buf->size_class != -1) {
+		g_static_mutex_lock(&pool_mutex);
+		if (num_free[buf->size_class] < POOL_MAX_FREE) {
+			buf->next = free_buffers[buf->size_class];
+			free_buffers[buf->size_class] = buf;
+			num_free[buf->size_class]++;
+			buf = NULL;
+		}
+		g_static_mutex_unlock(&pool_mutex);
+	}
+	g_free(buf);
+}
+
+/*
+ * Put buffers of at least size bytes in the pool until it holds count of
+ * them, so an acquisition doesn't allocate while it gets up to speed. Only
+ * up to POOL_MAX_FREE buffers are kept per size class.
+ */
+int packet_buffer_pool_prealloc(uint64_t size, int count)
+{
+	struct packet_buffer *buf;
+	int class, missing;
+
+	if ((class = size_class(size)) == -1)
+		return SIGROK_ERR;
+
+	g_static_mutex_lock(&pool_mutex);
+	missing = MIN(count, POOL_MAX_FREE) - num_free[class];
+	g_static_mutex_unlock(&pool_mutex);
+
+	/* Unreferencing a new buffer is what puts it in the pool. */
+	for (; missing > 0; missing--) {
+		if (!(buf = packet_buffer_new(size)))
+			return SIGROK_ERR_MALLOC;
+		packet_buffer_unref(buf);
+	}
+
+	return SIGROK_OK;
+}
+
+/* Free all unused buffers in the pool. */
+void packet_buffer_pool_cleanup(void)
+{
+	struct packet_buffer *buf;
+	int class;
+
+	g_static_mutex_lock(&pool_mutex);
+	for (class = 0; class < POOL_NUM_CLASSES; class++) {
+		while ((buf = free_buffers[class])) {
+			free_buffers[class] = buf->next;
+			g_free(buf);
+		}
+		num_free[class] = 0;
+	}
+	g_static_mutex_unlock(&pool_mutex);
+}
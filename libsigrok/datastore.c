@@ -20,12 +20,225 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib.h>
 #include <sigrok.h>
+#include "config.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
-static gpointer new_chunk(struct datastore **ds);
+/* Initial number of slots in the chunk pointer array. */
+#define DATASTORE_CHUNKS_INITIAL 16
 
-int datastore_new(int unitsize, struct datastore **ds)
+/* Initial number of slots in the runs array. */
+#define DATASTORE_RUNS_INITIAL 1024
+
+/* Units expanded at a time by datastore_put_run() without DATASTORE_RLE. */
+#define DATASTORE_RUN_EXPAND 4096
+
+static gpointer new_chunk(struct datastore *ds);
+
+#ifdef HAVE_SYS_MMAN_H
+/* Size of a chunk in the backing file, rounded up to whole pages. */
+static off_t mmap_chunk_size(struct datastore *ds)
+{
+	off_t pagesize, size;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	size = (off_t)DATASTORE_CHUNKSIZE * ds->ds_unitsize;
+
+	return (size + pagesize - 1) / pagesize * pagesize;
+}
+
+static int mmap_open(struct datastore *ds)
+{
+	char *filename;
+
+	filename = g_build_filename(g_get_tmp_dir(), "sigrok-datastore-XXXXXX",
+				    NULL);
+	ds->fd = g_mkstemp(filename);
+	if (ds->fd != -1) {
+		/*
+		 * The file only needs to live as long as the descriptor;
+		 * unlinking it now means it can't be left behind.
+		 */
+		unlink(filename);
+	}
+	g_free(filename);
+
+	return ds->fd == -1 ? SIGROK_ERR : SIGROK_OK;
+}
+
+static gpointer mmap_chunk(struct datastore *ds)
+{
+	off_t offset, size;
+	void *chunk;
+
+	/* Grow the (sparse) backing file by one chunk, then map it. */
+	size = mmap_chunk_size(ds);
+	offset = size * ds->num_chunks;
+	if (ftruncate(ds->fd, offset + size) == -1)
+		return NULL;
+
+	chunk = mmap(NULL, DATASTORE_CHUNKSIZE * ds->ds_unitsize,
+		     PROT_READ | PROT_WRITE, MAP_SHARED, ds->fd, offset);
+	if (chunk == MAP_FAILED)
+		return NULL;
+
+	return chunk;
+}
+#endif
+
+/*
+ * Set the bits for count units of a chunk's samples, starting at unit
+ * number offset inside the chunk, in its bit-planes. Only set bits take
+ * any work, and the planes start out cleared.
+ */
+static void planes_put(struct datastore *ds, uint64_t *planes,
+		       uint64_t offset, uint64_t count, unsigned char *data)
+{
+	uint64_t unit, word, bit;
+	unsigned int bits;
+	int i;
+
+	for (unit = offset; unit < offset + count; unit++) {
+		word = unit / 64;
+		bit = (uint64_t)1 << (unit % 64);
+		for (i = 0; i < ds->ds_unitsize; i++) {
+			bits = *data++;
+			while (bits) {
+				planes[(i * 8 + __builtin_ctz(bits))
+				       * DATASTORE_PLANE_WORDS + word] |= bit;
+				bits &= bits - 1;
+			}
+		}
+	}
+}
+
+/* The unit's bytes as they are in memory, in the low bytes of a word. */
+static uint64_t rle_value(struct datastore *ds, void *unit)
+{
+	uint64_t value;
+
+	value = 0;
+	memcpy(&value, unit, ds->ds_unitsize);
+
+	return value;
+}
+
+/* Add count units of the given value to the end of the datastore. */
+static int rle_append(struct datastore *ds, uint64_t value, uint64_t count)
+{
+	struct datastore_run *runs;
+	uint64_t size;
+
+	if (!count)
+		return SIGROK_OK;
+
+	if (!ds->num_runs || ds->runs[ds->num_runs - 1].value != value) {
+		if (ds->num_runs == ds->runs_size) {
+			size = ds->runs_size ? ds->runs_size * 2
+					     : DATASTORE_RUNS_INITIAL;
+			runs = g_try_realloc(ds->runs, size
+					* sizeof(struct datastore_run));
+			if (!runs)
+				return SIGROK_ERR_MALLOC;
+			ds->runs = runs;
+			ds->runs_size = size;
+		}
+		ds->runs[ds->num_runs].start = ds->num_units;
+		ds->runs[ds->num_runs].value = value;
+		ds->num_runs++;
+	}
+	ds->num_units += count;
+
+	return SIGROK_OK;
+}
+
+static int rle_put(struct datastore *ds, void *data, uint64_t count)
+{
+	uint64_t value, run, i;
+	char *unit;
+	int ret;
+
+	unit = data;
+	for (i = 0; i < count; i += run) {
+		value = rle_value(ds, unit);
+		run = 1;
+		unit += ds->ds_unitsize;
+		while (i + run < count && !memcmp(unit, unit - ds->ds_unitsize,
+						  ds->ds_unitsize)) {
+			run++;
+			unit += ds->ds_unitsize;
+		}
+		if ((ret = rle_append(ds, value, run)) != SIGROK_OK)
+			return ret;
+	}
+
+	return SIGROK_OK;
+}
+
+/* Returns the index of the run holding unit number unit. */
+static uint64_t rle_find(struct datastore *ds, uint64_t unit)
+{
+	uint64_t lo, hi, mid;
+
+	/* The first run always starts at unit 0. */
+	lo = 0;
+	hi = ds->num_runs - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (ds->runs[mid].start <= unit)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+static void rle_get(struct datastore *ds, uint64_t start, uint64_t count,
+		    void *buf)
+{
+	uint64_t run, end, unit;
+	char *dst;
+
+	if (!count)
+		return;
+
+	dst = buf;
+	unit = start;
+	for (run = rle_find(ds, start); unit < start + count; run++) {
+		if (run + 1 < ds->num_runs)
+			end = MIN(ds->runs[run + 1].start, start + count);
+		else
+			end = start + count;
+		for (; unit < end; unit++) {
+			memcpy(dst, &ds->runs[run].value, ds->ds_unitsize);
+			dst += ds->ds_unitsize;
+		}
+	}
+}
+
+/*
+ * Create a datastore for units of unitsize bytes. With DATASTORE_MMAP in
+ * flags, chunks are kept in a memory-mapped temporary file instead of in
+ * allocated memory, so the kernel can page out the parts of the capture
+ * that aren't being used and captures aren't limited by the amount of RAM.
+ *
+ * DATASTORE_BITPLANES additionally keeps a transposed copy of the samples,
+ * 64 samples per word for each probe. Code looking at only a few probes can
+ * then scan those with datastore_get_bitplane(), touching a fraction of the
+ * memory and using word operations (popcount, ctz, ...) on them.
+ *
+ * DATASTORE_RLE stores runs of identical units instead of the units
+ * themselves, which takes a tiny fraction of the memory for signals that
+ * rarely change. Units are expanded again by datastore_get(), but there
+ * is nothing for datastore_get_ptr() to point to. It can't be combined with
+ * the other flags, and units can be at most 8 bytes.
+ */
+int datastore_new(int unitsize, int flags, struct datastore **ds)
 {
 	if (!ds)
 		return SIGROK_ERR;
@@ -33,81 +246,346 @@ int datastore_new(int unitsize, struct datastore **ds)
 	if (unitsize <= 0)
 		return SIGROK_ERR; /* TODO: Different error? */
 
+#ifndef HAVE_SYS_MMAN_H
+	if (flags & DATASTORE_MMAP)
+		return SIGROK_ERR;
+#endif
+
+	if ((flags & DATASTORE_RLE) && (flags != DATASTORE_RLE
+				|| unitsize > (int)sizeof(uint64_t)))
+		return SIGROK_ERR;
+
 	if (!(*ds = g_malloc(sizeof(struct datastore))))
 		return SIGROK_ERR_MALLOC;
 
 	(*ds)->ds_unitsize = unitsize;
+	(*ds)->flags = flags;
+	(*ds)->fd = -1;
 	(*ds)->num_units = 0;
-	(*ds)->chunklist = NULL;
+	(*ds)->chunks = NULL;
+	(*ds)->num_chunks = 0;
+	(*ds)->chunks_size = 0;
+	(*ds)->planes = NULL;
+	(*ds)->runs = NULL;
+	(*ds)->num_runs = 0;
+	(*ds)->runs_size = 0;
+
+#ifdef HAVE_SYS_MMAN_H
+	if (flags & DATASTORE_MMAP) {
+		if (mmap_open(*ds) != SIGROK_OK) {
+			g_free(*ds);
+			*ds = NULL;
+			return SIGROK_ERR;
+		}
+	}
+#endif
 
 	return SIGROK_OK;
 }
 
 int datastore_destroy(struct datastore *ds)
 {
-	GSList *chunk;
+	unsigned int i;
 
 	if (!ds)
 		return SIGROK_ERR;
-	
-	for (chunk = ds->chunklist; chunk; chunk = chunk->next)
-		g_free(chunk->data);
-	g_slist_free(ds->chunklist);
+
+	for (i = 0; i < ds->num_chunks; i++) {
+#ifdef HAVE_SYS_MMAN_H
+		if (ds->flags & DATASTORE_MMAP) {
+			munmap(ds->chunks[i],
+			       DATASTORE_CHUNKSIZE * ds->ds_unitsize);
+			continue;
+		}
+#endif
+		g_free(ds->chunks[i]);
+	}
+	g_free(ds->chunks);
+	if (ds->planes) {
+		for (i = 0; i < ds->num_chunks; i++)
+			g_free(ds->planes[i]);
+		g_free(ds->planes);
+	}
+	g_free(ds->runs);
+	if (ds->fd != -1)
+		close(ds->fd);
 	g_free(ds);
 
 	return SIGROK_OK;
 }
 
-void datastore_put(struct datastore *ds, void *data, unsigned int length,
-		   int in_unitsize, int *probelist)
+/*
+ * Append length bytes of samples to the datastore. Only whole units are
+ * stored; the chunk holding the next free unit is found by index, so this
+ * takes constant time regardless of how much is already stored.
+ */
+int datastore_put(struct datastore *ds, void *data, uint64_t length,
+		  int in_unitsize, int *probelist)
 {
-	unsigned int stored;
-	int capacity, size, num_chunks, chunk_bytes_free, chunk_offset;
+	uint64_t stored, size, chunk_bytes, chunk_offset;
+	unsigned int chunk_num;
 	gpointer chunk;
 
 	/* Avoid compiler warnings. */
 	in_unitsize = in_unitsize;
 	probelist = probelist;
 
-	if (ds->chunklist == NULL)
-		chunk = new_chunk(&ds);
-	else
-		chunk = g_slist_last(ds->chunklist)->data;
+	length -= length % ds->ds_unitsize;
+	if (ds->flags & DATASTORE_RLE)
+		return rle_put(ds, data, length / ds->ds_unitsize);
+
+	chunk_bytes = (uint64_t)DATASTORE_CHUNKSIZE * ds->ds_unitsize;
 
-	num_chunks = g_slist_length(ds->chunklist);
-	capacity = (num_chunks * DATASTORE_CHUNKSIZE);
-	chunk_bytes_free = capacity - (ds->ds_unitsize * ds->num_units);
-	chunk_offset = capacity - (DATASTORE_CHUNKSIZE * (num_chunks - 1))
-		       - chunk_bytes_free;
 	stored = 0;
 	while (stored < length) {
-		if (chunk_bytes_free == 0) {
-			chunk = new_chunk(&ds);
-			chunk_bytes_free = DATASTORE_CHUNKSIZE;
-			chunk_offset = 0;
+		chunk_num = ds->num_units / DATASTORE_CHUNKSIZE;
+		chunk_offset = (ds->num_units % DATASTORE_CHUNKSIZE)
+			       * ds->ds_unitsize;
+		if (chunk_num == ds->num_chunks) {
+			if (!(chunk = new_chunk(ds)))
+				return SIGROK_ERR_MALLOC;
+		} else {
+			chunk = ds->chunks[chunk_num];
 		}
 
-		if (length - stored > (unsigned int)chunk_bytes_free)
-			size = chunk_bytes_free;
+		if (length - stored > chunk_bytes - chunk_offset)
+			size = chunk_bytes - chunk_offset;
 		else
 			/* Last part, won't fill up this chunk. */
 			size = length - stored;
 
-		memcpy(chunk + chunk_offset, data + stored, size);
-		chunk_bytes_free -= size;
+		memcpy((char *)chunk + chunk_offset, (char *)data + stored,
+		       size);
+		if (ds->flags & DATASTORE_BITPLANES)
+			planes_put(ds, ds->planes[chunk_num],
+				   chunk_offset / ds->ds_unitsize,
+				   size / ds->ds_unitsize,
+				   (unsigned char *)data + stored);
+		ds->num_units += size / ds->ds_unitsize;
 		stored += size;
 	}
-	ds->num_units += stored / ds->ds_unitsize;
+
+	return SIGROK_OK;
 }
 
-static gpointer new_chunk(struct datastore **ds)
+/*
+ * Append count copies of the given unit. Drivers whose hardware sends
+ * run-length encoded samples can use this to store them without expanding
+ * them first, when the datastore uses DATASTORE_RLE.
+ */
+int datastore_put_run(struct datastore *ds, void *unit, uint64_t count)
 {
-	gpointer chunk;
+	uint64_t done, n, i;
+	char *buf;
+	int ret;
+
+	if (!ds || !unit)
+		return SIGROK_ERR;
+
+	if (ds->flags & DATASTORE_RLE)
+		return rle_append(ds, rle_value(ds, unit), count);
+
+	n = MIN(count, DATASTORE_RUN_EXPAND);
+	if (!(buf = g_try_malloc(n * ds->ds_unitsize)))
+		return SIGROK_ERR_MALLOC;
+	for (i = 0; i < n; i++)
+		memcpy(buf + i * ds->ds_unitsize, unit, ds->ds_unitsize);
+
+	ret = SIGROK_OK;
+	for (done = 0; done < count && ret == SIGROK_OK; done += n) {
+		n = MIN(count - done, DATASTORE_RUN_EXPAND);
+		ret = datastore_put(ds, buf, n * ds->ds_unitsize,
+				    ds->ds_unitsize, NULL);
+	}
+	g_free(buf);
+
+	return ret;
+}
+
+/*
+ * Copy count units, starting at unit number start, into buf. The buffer
+ * must be able to hold count * ds_unitsize bytes.
+ */
+int datastore_get(struct datastore *ds, uint64_t start, uint64_t count,
+		  void *buf)
+{
+	uint64_t done, size;
+	void *src;
+
+	if (!ds || !buf)
+		return SIGROK_ERR;
+
+	if (start > ds->num_units || count > ds->num_units - start)
+		return SIGROK_ERR;
+
+	if (ds->flags & DATASTORE_RLE) {
+		rle_get(ds, start, count, buf);
+		return SIGROK_OK;
+	}
+
+	done = 0;
+	while (done < count) {
+		src = datastore_get_ptr(ds, start + done, &size);
+		if (size > count - done)
+			size = count - done;
+		memcpy((char *)buf + done * ds->ds_unitsize, src,
+		       size * ds->ds_unitsize);
+		done += size;
+	}
+
+	return SIGROK_OK;
+}
+
+/*
+ * Return a pointer to unit number start inside the datastore, without
+ * copying. The number of units that can be read contiguously from the
+ * returned pointer is stored in count. Returns NULL if start is out
+ * of range, or if the datastore has no chunks (DATASTORE_RLE).
+ */
+void *datastore_get_ptr(struct datastore *ds, uint64_t start, uint64_t *count)
+{
+	uint64_t chunk_offset;
+
+	if (!ds || start >= ds->num_units || (ds->flags & DATASTORE_RLE))
+		return NULL;
+
+	chunk_offset = start % DATASTORE_CHUNKSIZE;
+	if (count) {
+		*count = DATASTORE_CHUNKSIZE - chunk_offset;
+		if (*count > ds->num_units - start)
+			*count = ds->num_units - start;
+	}
 
-	if (!(chunk = malloc(DATASTORE_CHUNKSIZE * (*ds)->ds_unitsize)))
+	return (char *)ds->chunks[start / DATASTORE_CHUNKSIZE]
+	       + chunk_offset * ds->ds_unitsize;
+}
+
+/*
+ * Copy count samples of one probe, starting at unit number start, into buf
+ * as a bit-plane: bit n of buf[0] is the probe's value in sample start + n,
+ * and so on. Unused bits in the last word are cleared. Probes are numbered
+ * from 1, and the datastore must have been created with DATASTORE_BITPLANES.
+ */
+int datastore_get_bitplane(struct datastore *ds, int probe, uint64_t start,
+			   uint64_t count, uint64_t *buf)
+{
+	uint64_t *src, *next, words, avail, i, j, n, shift, base;
+
+	if (!ds || !buf || !(ds->flags & DATASTORE_BITPLANES))
+		return SIGROK_ERR;
+
+	if (probe < 1 || probe > ds->ds_unitsize * 8)
+		return SIGROK_ERR;
+
+	if (start > ds->num_units || count > ds->num_units - start)
+		return SIGROK_ERR;
+
+	/* Output word i is made up of source words i and i + 1, shifted. */
+	shift = start % 64;
+	base = start - shift;
+	words = (count + 63) / 64;
+	for (i = 0; i < words; i += n) {
+		src = datastore_get_bitplane_ptr(ds, probe, base + i * 64,
+						 &avail);
+		n = (avail + 63) / 64;
+		if (n > words - i)
+			n = words - i;
+		if (!shift) {
+			memcpy(buf + i, src, n * sizeof(uint64_t));
+			continue;
+		}
+		for (j = 0; j < n; j++) {
+			buf[i + j] = src[j] >> shift;
+			if (j + 1 < (avail + 63) / 64)
+				next = src + j + 1;
+			else
+				/* In the next chunk, if there is one. */
+				next = datastore_get_bitplane_ptr(ds, probe,
+					base + (i + j + 1) * 64, NULL);
+			if (next)
+				buf[i + j] |= *next << (64 - shift);
+		}
+	}
+
+	if (count % 64)
+		buf[count / 64] &= ((uint64_t)1 << (count % 64)) - 1;
+
+	return SIGROK_OK;
+}
+
+/*
+ * Return a pointer to the bit-plane word holding one probe's value for unit
+ * number start, which must be a multiple of 64. The number of units that
+ * can be read contiguously from there is stored in count. Returns NULL if
+ * start is out of range or not aligned.
+ */
+uint64_t *datastore_get_bitplane_ptr(struct datastore *ds, int probe,
+				     uint64_t start, uint64_t *count)
+{
+	uint64_t chunk_offset;
+
+	if (!ds || !(ds->flags & DATASTORE_BITPLANES) || start % 64
+	    || start >= ds->num_units)
+		return NULL;
+
+	if (probe < 1 || probe > ds->ds_unitsize * 8)
+		return NULL;
+
+	chunk_offset = start % DATASTORE_CHUNKSIZE;
+	if (count) {
+		*count = DATASTORE_CHUNKSIZE - chunk_offset;
+		if (*count > ds->num_units - start)
+			*count = ds->num_units - start;
+	}
+
+	return ds->planes[start / DATASTORE_CHUNKSIZE]
+	       + (probe - 1) * DATASTORE_PLANE_WORDS + chunk_offset / 64;
+}
+
+static gpointer new_chunk(struct datastore *ds)
+{
+	gpointer chunk, *chunks;
+	uint64_t **planes;
+	unsigned int size;
+
+	if (ds->num_chunks == ds->chunks_size) {
+		/* Double the pointer array, so appends stay amortized O(1). */
+		size = ds->chunks_size ? ds->chunks_size * 2
+				       : DATASTORE_CHUNKS_INITIAL;
+		chunks = g_try_realloc(ds->chunks, size * sizeof(gpointer));
+		if (!chunks)
+			return NULL;
+		ds->chunks = chunks;
+		if (ds->flags & DATASTORE_BITPLANES) {
+			planes = g_try_realloc(ds->planes,
+					       size * sizeof(uint64_t *));
+			if (!planes)
+				return NULL;
+			ds->planes = planes;
+		}
+		ds->chunks_size = size;
+	}
+
+	if (ds->flags & DATASTORE_BITPLANES) {
+		ds->planes[ds->num_chunks] = g_try_malloc0(ds->ds_unitsize * 8
+				* DATASTORE_PLANE_WORDS * sizeof(uint64_t));
+		if (!ds->planes[ds->num_chunks])
+			return NULL;
+	}
+
+#ifdef HAVE_SYS_MMAN_H
+	if (ds->flags & DATASTORE_MMAP)
+		chunk = mmap_chunk(ds);
+	else
+#endif
+		chunk = g_try_malloc(DATASTORE_CHUNKSIZE * ds->ds_unitsize);
+	if (!chunk) {
+		if (ds->flags & DATASTORE_BITPLANES)
+			g_free(ds->planes[ds->num_chunks]);
 		return NULL;
+	}
 
-	(*ds)->chunklist = g_slist_append((*ds)->chunklist, chunk);
+	ds->chunks[ds->num_chunks++] = chunk;
 
 	return chunk;
 }
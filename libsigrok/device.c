@@ -25,6 +25,9 @@ extern struct sigrok_global *global;
 
 GSList *devices = NULL;
 
+/* Devices may come and go from several sessions' threads at once. */
+static GStaticMutex devices_mutex = G_STATIC_MUTEX_INIT;
+
 void device_scan(void)
 {
 	GSList *plugins, *l;
@@ -78,7 +81,9 @@ struct device *device_new(struct device_plugin *plugin, int plugin_index,
 	device = g_malloc0(sizeof(struct device));
 	device->plugin = plugin;
 	device->plugin_index = plugin_index;
+	g_static_mutex_lock(&devices_mutex);
 	devices = g_slist_append(devices, device);
+	g_static_mutex_unlock(&devices_mutex);
 
 	for (i = 0; i < num_probes; i++) {
 		snprintf(probename, 16, "%d", i + 1);
@@ -110,7 +115,9 @@ void device_destroy(struct device *device)
 	 * in plugin.
 	 */
 
+	g_static_mutex_lock(&devices_mutex);
 	devices = g_slist_remove(devices, device);
+	g_static_mutex_unlock(&devices_mutex);
 	if (device->probes) {
 		for (pnum = 1; pnum <= g_slist_length(device->probes); pnum++)
 			device_probe_clear(device, pnum);
@@ -222,4 +229,26 @@ free:
 	return NULL;
 }
 
+/*
+ * Whether the device's driver handles triggers of this type itself. Others
+ * are left to the session, see session_bus().
+ */
+gboolean device_trigger_supported(struct device *device, int type)
+{
+	int *types, i;
+
+	/* Protocol triggers need decoder output, only the session has it. */
+	if (!device->plugin || type == TRIGGER_TYPE_PROTO)
+		return FALSE;
+
+	types = device->plugin->get_device_info(device->plugin_index,
+						DI_TRIGGER_TYPES);
+	for (i = 0; types && types[i]; i++) {
+		if (types[i] == type)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 
@@ -20,8 +20,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <glib.h>
 #include <sigrok.h>
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define FILTER_PEXT
+#endif
+
 /*
  * Convert sample from maximum probes -- the way the hardware driver sent
  * it -- to a sample taking up only as much space as required, with
@@ -51,12 +57,13 @@ int filter_probes(int in_unitsize, int out_unitsize, int *probelist,
 
 	/* If we reached this point, not all probes are used, so "compress". */
 	in_offset = out_offset = 0;
-	while (in_offset <= length_in - in_unitsize) {
+	sample_in = 0;
+	while (in_offset + in_unitsize <= length_in) {
 		memcpy(&sample_in, data_in + in_offset, in_unitsize);
 		sample_out = out_bit = 0;
 		for (i = 0; probelist[i]; i++) {
-			if (sample_in & (1 << (probelist[i] - 1)))
-				sample_out |= (1 << out_bit);
+			if (sample_in & ((uint64_t)1 << (probelist[i] - 1)))
+				sample_out |= ((uint64_t)1 << out_bit);
 			out_bit++;
 		}
 		memcpy((*data_out) + out_offset, &sample_out, out_unitsize);
@@ -67,3 +74,220 @@ int filter_probes(int in_unitsize, int out_unitsize, int *probelist,
 
 	return SIGROK_OK;
 }
+
+/*
+ * Prepare a filter for samples of in_unitsize bytes, keeping the probes in
+ * probelist (numbered from 1, terminated by 0) packed into out_unitsize
+ * bytes. The probe mapping is worked out here once, so that filter_run()
+ * only needs a table lookup per input byte, or a single PEXT instruction
+ * per sample on CPUs that have BMI2.
+ */
+int filter_new(int in_unitsize, int out_unitsize, int *probelist,
+	       struct probe_filter **filter)
+{
+	struct probe_filter *f;
+	int probe, byte, bit, value, ascending, i;
+
+	if (in_unitsize < 1 || in_unitsize > 8 || out_unitsize < 1
+	    || out_unitsize > 8)
+		return SIGROK_ERR;
+
+	if (!(f = g_try_malloc0(sizeof(struct probe_filter))))
+		return SIGROK_ERR_MALLOC;
+	f->in_unitsize = in_unitsize;
+	f->out_unitsize = out_unitsize;
+
+	ascending = TRUE;
+	for (i = 0; probelist[i]; i++) {
+		probe = probelist[i] - 1;
+		if (probe < 0 || probe >= in_unitsize * 8
+		    || i >= out_unitsize * 8) {
+			g_free(f);
+			return SIGROK_ERR;
+		}
+		if (i > 0 && probe <= probelist[i - 1] - 1)
+			ascending = FALSE;
+		f->mask |= (uint64_t)1 << probe;
+
+		byte = probe / 8;
+		bit = probe % 8;
+		for (value = 0; value < 256; value++) {
+			if (value & (1 << bit))
+				f->lut[byte][value] |= (uint64_t)1 << i;
+		}
+	}
+	f->num_probes = i;
+	f->identity = ascending && f->num_probes == in_unitsize * 8
+		      && in_unitsize == out_unitsize;
+
+	for (byte = 0; byte < in_unitsize; byte++) {
+		if (f->mask & ((uint64_t)0xff << (byte * 8)))
+			f->bytes[f->num_bytes++] = byte;
+	}
+
+#ifdef FILTER_PEXT
+	/* A single table lookup beats PEXT, so only use it for more. */
+	__builtin_cpu_init();
+	f->use_pext = ascending && f->num_bytes > 1
+		      && __builtin_cpu_supports("bmi2");
+#endif
+
+	*filter = f;
+
+	return SIGROK_OK;
+}
+
+void filter_destroy(struct probe_filter *filter)
+{
+	g_free(filter->buf);
+	g_free(filter);
+}
+
+/*
+ * Unit sized loads and stores. Fixed size memcpy() calls compile down to
+ * single moves, which makes a big difference in the per-sample loops.
+ */
+static inline uint64_t unit_load(unsigned char *p, int unitsize)
+{
+	uint64_t v64;
+	uint32_t v32;
+	uint16_t v16;
+
+	switch (unitsize) {
+	case 1:
+		return p[0];
+	case 2:
+		memcpy(&v16, p, 2);
+		return v16;
+	case 4:
+		memcpy(&v32, p, 4);
+		return v32;
+	case 8:
+		memcpy(&v64, p, 8);
+		return v64;
+	default:
+		v64 = 0;
+		memcpy(&v64, p, unitsize);
+		return v64;
+	}
+}
+
+static inline void unit_store(unsigned char *p, uint64_t v, int unitsize)
+{
+	uint32_t v32;
+	uint16_t v16;
+
+	switch (unitsize) {
+	case 1:
+		p[0] = v;
+		break;
+	case 2:
+		v16 = v;
+		memcpy(p, &v16, 2);
+		break;
+	case 4:
+		v32 = v;
+		memcpy(p, &v32, 4);
+		break;
+	default:
+		memcpy(p, &v, unitsize);
+		break;
+	}
+}
+
+static void filter_lut(struct probe_filter *f, unsigned char *in,
+		       unsigned char *out, uint64_t num_samples)
+{
+	uint64_t sample_out, n;
+	int i;
+
+	for (n = 0; n < num_samples; n++) {
+		sample_out = 0;
+		for (i = 0; i < f->num_bytes; i++)
+			sample_out |= f->lut[f->bytes[i]][in[f->bytes[i]]];
+		unit_store(out, sample_out, f->out_unitsize);
+		in += f->in_unitsize;
+		out += f->out_unitsize;
+	}
+}
+
+#ifdef FILTER_PEXT
+__attribute__((target("bmi2")))
+static void filter_pext(struct probe_filter *f, unsigned char *in,
+			unsigned char *out, uint64_t num_samples)
+{
+	uint64_t sample_out, n;
+
+	for (n = 0; n < num_samples; n++) {
+		sample_out = _pext_u64(unit_load(in, f->in_unitsize), f->mask);
+		unit_store(out, sample_out, f->out_unitsize);
+		in += f->in_unitsize;
+		out += f->out_unitsize;
+	}
+}
+#endif
+
+/*
+ * Same as filter_probes(), with the mapping prepared by filter_new(), into
+ * the caller's buffer. It must be able to hold the output: length_in /
+ * in_unitsize units of out_unitsize bytes.
+ */
+int filter_run_into(struct probe_filter *filter, char *data_in,
+		    uint64_t length_in, char *data_out, uint64_t *length_out)
+{
+	uint64_t num_samples;
+
+	num_samples = length_in / filter->in_unitsize;
+	*length_out = num_samples * filter->out_unitsize;
+
+	if (filter->identity) {
+		/* All probes are used -- no need to compress anything. */
+		memcpy(data_out, data_in, *length_out);
+		return SIGROK_OK;
+	}
+
+#ifdef FILTER_PEXT
+	if (filter->use_pext) {
+		filter_pext(filter, (unsigned char *)data_in,
+			    (unsigned char *)data_out, num_samples);
+		return SIGROK_OK;
+	}
+#endif
+	filter_lut(filter, (unsigned char *)data_in,
+		   (unsigned char *)data_out, num_samples);
+
+	return SIGROK_OK;
+}
+
+/*
+ * Filter a packet's worth of samples without allocating anything per
+ * packet. *data_out is either data_in itself, when all probes are used in
+ * order, or the filter's own output buffer, which is reused from one call
+ * to the next. Either way it is only valid until the next filter_run() or
+ * filter_destroy() call, and must not be freed.
+ */
+int filter_run(struct probe_filter *filter, char *data_in,
+	       uint64_t length_in, char **data_out, uint64_t *length_out)
+{
+	uint64_t size;
+	char *buf;
+
+	if (filter->identity) {
+		*data_out = data_in;
+		*length_out = length_in - length_in % filter->in_unitsize;
+		return SIGROK_OK;
+	}
+
+	size = length_in / filter->in_unitsize * filter->out_unitsize;
+	if (size > filter->buf_size) {
+		/* Packets are usually the same size, so this rarely runs. */
+		if (!(buf = g_try_realloc(filter->buf, size)))
+			return SIGROK_ERR_MALLOC;
+		filter->buf = buf;
+		filter->buf_size = size;
+	}
+	*data_out = filter->buf;
+
+	return filter_run_into(filter, data_in, length_in, filter->buf,
+			       length_out);
+}
@@ -236,21 +236,26 @@ static void thread_func(void *data)
 static int receive_data(int fd, int revents, void *user_data)
 {
 	struct datafeed_packet packet;
-	/* uint16_t samples[1000]; */
-	char c[BUFSIZE];
-	uint64_t z;
+	struct packet_buffer *buf;
+	ssize_t z;
 
 	/* Avoid compiler warnings. */
 	revents = revents;
 
-	z = read(fd, &c, BUFSIZE);
+	if (!(buf = packet_buffer_new(BUFSIZE)))
+		return TRUE;
+
+	z = read(fd, buf->data, BUFSIZE);
 	if (z > 0) {
 		packet.type = DF_LOGIC;
 		packet.length = z;
 		packet.unitsize = 1;
-		packet.payload = c;
+		packet.payload = buf->data;
+		packet.buffer = buf;
 		session_bus(user_data, &packet);
 	}
+	packet_buffer_unref(buf);
+
 	return TRUE;
 }
 
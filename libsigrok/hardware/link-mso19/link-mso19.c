@@ -59,8 +59,6 @@ static int trigger_types[] = {
 	TRIGGER_TYPE_LOGIC,
 	TRIGGER_TYPE_EDGE,
 	TRIGGER_TYPE_WIDTH,
-	TRIGGER_TYPE_COUNT,
-	TRIGGER_TYPE_PROTO,
 	0,
 };
 
@@ -758,6 +756,7 @@ static int receive_data(int fd, int revents, void *user_data)
 	packet.length = 1024;
 	packet.unitsize = 1;
 	packet.payload = logic_out;
+	packet.buffer = NULL;
 	session_bus(mso->session_id, &packet);
 
 
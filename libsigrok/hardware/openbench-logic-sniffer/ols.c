@@ -81,7 +81,6 @@
 
 static int trigger_types[] = {
 	TRIGGER_TYPE_LOGIC,
-	TRIGGER_TYPE_SERIAL,
 	0,
 };
 
@@ -507,6 +506,7 @@ static int receive_data(int fd, int revents, void *user_data)
 	static unsigned char sample[4] = { 0, 0, 0, 0 };
 	static unsigned char tmp_sample[4];
 	static unsigned char *raw_sample_buf = NULL;
+	static struct packet_buffer *sample_pbuf = NULL;
 	int count, buflen, num_channels, offset, i, j;
 	struct datafeed_packet packet;
 	unsigned char byte, *buffer;
@@ -520,7 +520,9 @@ static int receive_data(int fd, int revents, void *user_data)
 		 */
 		source_remove(fd);
 		source_add(fd, G_IO_IN, 30, receive_data, user_data);
-		raw_sample_buf = malloc(limit_samples * 4);
+		if (!(sample_pbuf = packet_buffer_new(limit_samples * 4)))
+			return FALSE;
+		raw_sample_buf = sample_pbuf->data;
 		/* fill with 1010... for debugging */
 		memset(raw_sample_buf, 0x82, limit_samples * 4);
 	}
@@ -630,6 +632,7 @@ static int receive_data(int fd, int revents, void *user_data)
 				packet.length = trigger_at * 4;
 				packet.unitsize = 4;
 				packet.payload = raw_sample_buf;
+				packet.buffer = sample_pbuf;
 				session_bus(user_data, &packet);
 			}
 
@@ -641,15 +644,19 @@ static int receive_data(int fd, int revents, void *user_data)
 			packet.length = (limit_samples * 4) - (trigger_at * 4);
 			packet.unitsize = 4;
 			packet.payload = raw_sample_buf + trigger_at * 4;
+			packet.buffer = sample_pbuf;
 			session_bus(user_data, &packet);
 		} else {
 			packet.type = DF_LOGIC;
 			packet.length = limit_samples * 4;
 			packet.unitsize = 4;
 			packet.payload = raw_sample_buf;
+			packet.buffer = sample_pbuf;
 			session_bus(user_data, &packet);
 		}
-		free(raw_sample_buf);
+		packet_buffer_unref(sample_pbuf);
+		sample_pbuf = NULL;
+		raw_sample_buf = NULL;
 
 		serial_flush(fd);
 		serial_close(fd);
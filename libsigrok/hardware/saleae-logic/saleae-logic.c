@@ -19,7 +19,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
+#ifdef _POSIX_THREAD_PRIORITY_SCHEDULING
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include <inttypes.h>
 #include <glib.h>
 #include <libusb.h>
@@ -41,11 +47,29 @@
 
 /* delay in ms */
 #define FIRMWARE_RENUM_DELAY   2000
-#define NUM_SIMUL_TRANSFERS    10
-#define MAX_EMPTY_TRANSFERS    (NUM_SIMUL_TRANSFERS * 2)
 
-/* Software trigger implementation: positive values indicate trigger stage. */
+/*
+ * Transfers kept in flight, unless configured otherwise. The default size
+ * holds about TRANSFER_MSEC worth of samples: big enough to keep up at
+ * 24MHz, small enough not to hold up slow samplerates.
+ */
+#define NUM_SIMUL_TRANSFERS    32
+#define MAX_SIMUL_TRANSFERS    256
+#define TRANSFER_MSEC          10
+#define MIN_TRANSFER_SIZE      4096
+#define MAX_TRANSFER_SIZE      (256 * 1024)
+/* Transfers go in multiples of the bulk endpoint's packet size. */
+#define USB_PACKET_SIZE        512
+
+/* Completed transfers the USB thread can queue up, a power of two */
+#define TRANSFER_QUEUE_LEN     1024
+/* How often the session takes transfers off the queue, in ms */
+#define TRANSFER_QUEUE_POLL    10
+
+/* trigger_stage once the software trigger fired, it's 0 before that. */
 #define TRIGGER_FIRED          -1
+/* Most samples kept from before the trigger, whatever the capture ratio */
+#define MAX_PRETRIGGER         (16 * 1024 * 1024)
 
 static int trigger_types[] = {
 	TRIGGER_TYPE_LOGIC,
@@ -60,8 +84,12 @@ static int capabilities[] = {
 	/* These are really implemented in the driver, not the hardware. */
 	HWCAP_PROBECONFIG,
 	HWCAP_TRIGGERCONFIG,
+	HWCAP_CAPTURE_RATIO,
 	HWCAP_LIMIT_SAMPLES,
 	HWCAP_CONTINUOUS,
+	HWCAP_USB_THREAD,
+	HWCAP_USB_TRANSFERS,
+	HWCAP_USB_TRANSFER_SIZE,
 	0,
 };
 
@@ -99,18 +127,71 @@ static struct samplerates samplerates = {
 	supported_samplerates,
 };
 
-/* TODO: All of these should go in a device-specific struct. */
-static uint64_t cur_samplerate = 0;
-static uint64_t limit_samples = 0;
-static uint8_t probe_mask = 0;
-static uint8_t trigger_mask[NUM_TRIGGER_STAGES] = { 0 };
-static uint8_t trigger_value[NUM_TRIGGER_STAGES] = { 0 };
-static uint8_t trigger_buffer[NUM_TRIGGER_STAGES] = { 0 };
+/* A transfer the USB thread received, with its samples. */
+struct done_transfer {
+	struct packet_buffer *pbuf;
+	int length;
+};
 
-int trigger_stage = TRIGGER_FIRED;
+/* Per-device state, in sdi->priv. */
+struct saleae_logic {
+	uint64_t cur_samplerate;
+	uint64_t limit_samples;
+	uint8_t probe_mask;
+	/* Software trigger, NULL if there is none */
+	struct soft_trigger *trigger;
+	/* 0 while waiting for the trigger, TRIGGER_FIRED after */
+	int trigger_stage;
+
+	/* Percentage of limit_samples to keep from before the trigger */
+	uint64_t capture_ratio;
+	/*
+	 * Circular buffer with the latest samples while waiting for the
+	 * trigger, one byte per sample. It has room for the samples that
+	 * matched the trigger on top of the pretrig_samples wanted.
+	 */
+	uint8_t *pretrig;
+	uint64_t pretrig_samples;
+	uint64_t pretrig_size;
+	/* Where the next sample goes, and how many are in there */
+	uint64_t pretrig_pos;
+	uint64_t pretrig_fill;
+
+	/* Samples sent so far, only used from the session's thread */
+	uint64_t num_samples;
+	/* Set once the acquisition has ended, the USB thread checks it too */
+	volatile gint ended;
+	int empty_transfer_count;
+	gpointer session_id;
+
+	/* Configured transfer count and size, 0 for the defaults */
+	int num_transfers;
+	int transfer_size;
+	/* What this acquisition uses */
+	int cur_transfer_size;
+	unsigned int transfer_timeout;
+	/* Transfers submitted and not completed yet */
+	int transfers_pending;
+	/* Transfers resubmitted after all others had completed */
+	unsigned int late_resubmits;
+	unsigned int failed_resubmits;
+
+	/* Handle USB events in a thread of our own, HWCAP_USB_THREAD */
+	gboolean use_thread;
+	GThread *usb_thread;
+	volatile gint thread_quit;
+	/*
+	 * Transfers handed from the USB thread to the session's thread. The
+	 * USB thread only moves head, the session only tail.
+	 */
+	struct done_transfer done[TRANSFER_QUEUE_LEN];
+	volatile gint done_head;
+	volatile gint done_tail;
+	unsigned int done_overruns;
+};
 
 static int hw_set_configuration(int device_index, int capability, void *value);
-static void hw_stop_acquisition(int device_index, gpointer session_device_id);
+static void stop_acquisition(struct sigrok_device_instance *sdi);
 
 /**
  * Check the USB configuration to determine if this is a Saleae Logic.
@@ -247,31 +328,31 @@ static void close_device(struct sigrok_device_instance *sdi)
 	sdi->status = ST_INACTIVE;
 }
 
-static int configure_probes(GSList *probes)
+static int configure_probes(struct saleae_logic *sl, GSList *probes)
 {
 	struct probe *probe;
 	GSList *l;
 
-	probe_mask = 0;
+	sl->probe_mask = 0;
 	for (l = probes; l; l = l->next) {
 		probe = (struct probe *)l->data;
 		if (!probe->enabled)
 			continue;
-		probe_mask |= 1 << (probe->index - 1);
+		sl->probe_mask |= 1 << (probe->index - 1);
 	}
 	return SIGROK_OK;
 }
 
 
-static int configure_triggers(GSList *triggers)
+static int configure_triggers(struct saleae_logic *sl, GSList *triggers)
 {
 	struct trigger *trigger;
 	GSList *l;
-	int i;
+	int ret;
 
-	for (i = 0; i < NUM_TRIGGER_STAGES; i++) {
-		trigger_mask[i] = 0;
-		trigger_value[i] = 0;
+	if (sl->trigger) {
+		soft_trigger_destroy(sl->trigger);
+		sl->trigger = NULL;
 	}
 
 	for (l = triggers; l; l = l->next) {
@@ -281,18 +362,16 @@ static int configure_triggers(GSList *triggers)
 		case TRIGGER_TYPE_LOGIC:
 			if (trigger->logic->n > NUM_TRIGGER_STAGES)
 				return SIGROK_ERR;
-			for (i = 0; i < trigger->logic->n; i++) {
-				trigger_value[i] =
-					trigger->logic->value[i];
-				trigger_mask[i] =
-					trigger->logic->mask[i];
-			}
+			if (sl->trigger)
+				soft_trigger_destroy(sl->trigger);
+			if ((ret = soft_trigger_new(trigger, 1, 0,
+						    &sl->trigger)) != SIGROK_OK)
+				return ret;
 			break;
 		default:
 			return SIGROK_ERR;
 		}
 	}
-	trigger_stage = 0;
 
 	return SIGROK_OK;
 }
@@ -304,6 +383,7 @@ static int configure_triggers(GSList *triggers)
 static int hw_init(char *deviceinfo)
 {
 	struct sigrok_device_instance *sdi;
+	struct saleae_logic *sl;
 	struct libusb_device_descriptor des;
 	libusb_device **devlist;
 	int err, devcnt, i;
@@ -333,6 +413,12 @@ static int hw_init(char *deviceinfo)
 			USB_VENDOR_NAME, USB_MODEL_NAME, USB_MODEL_VERSION);
 		if (!sdi)
 			return 0;
+		if (!(sl = g_try_malloc0(sizeof(struct saleae_logic)))) {
+			sigrok_device_instance_free(sdi);
+			return 0;
+		}
+		sl->trigger_stage = TRIGGER_FIRED;
+		sdi->priv = sl;
 		device_instances = g_slist_append(device_instances, sdi);
 
 		if (check_conf_profile(devlist[i]) == 0) {
@@ -364,6 +450,7 @@ static int hw_opendev(int device_index)
 {
 	GTimeVal cur_time;
 	struct sigrok_device_instance *sdi;
+	struct saleae_logic *sl;
 	int timediff, err;
 	unsigned int cur, upd;
 
@@ -394,7 +481,8 @@ static int hw_opendev(int device_index)
 		return SIGROK_ERR;
 	}
 
-	if (cur_samplerate == 0) {
+	sl = sdi->priv;
+	if (sl->cur_samplerate == 0) {
 		/* Samplerate hasn't been set; default to the slowest one. */
 		if (hw_set_configuration(device_index, HWCAP_SAMPLERATE,
 		    &supported_samplerates[0]) == SIGROK_ERR)
@@ -414,6 +502,8 @@ static void hw_closedev(int device_index)
 
 static void hw_cleanup(void)
 {
+	struct sigrok_device_instance *sdi;
+	struct saleae_logic *sl;
 	GSList *l;
 
 	/* Properly close all devices... */
@@ -421,8 +511,15 @@ static void hw_cleanup(void)
 		close_device((struct sigrok_device_instance *)l->data);
 
 	/* ...and free all their memory. */
-	for (l = device_instances; l; l = l->next)
-		g_free(l->data);
+	for (l = device_instances; l; l = l->next) {
+		sdi = l->data;
+		sl = sdi->priv;
+		if (sl->trigger)
+			soft_trigger_destroy(sl->trigger);
+		g_free(sl->pretrig);
+		g_free(sdi->priv);
+		sigrok_device_instance_free(sdi);
+	}
 	g_slist_free(device_instances);
 	device_instances = NULL;
 
@@ -434,10 +531,12 @@ static void hw_cleanup(void)
 static void *hw_get_device_info(int device_index, int device_info_id)
 {
 	struct sigrok_device_instance *sdi;
+	struct saleae_logic *sl;
 	void *info = NULL;
 
 	if (!(sdi = get_sigrok_device_instance(device_instances, device_index)))
 		return NULL;
+	sl = sdi->priv;
 
 	switch (device_info_id) {
 	case DI_INSTANCE:
@@ -453,7 +552,7 @@ static void *hw_get_device_info(int device_index, int device_info_id)
 		info = &trigger_types;
 		break;
 	case DI_CUR_SAMPLERATE:
-		info = &cur_samplerate;
+		info = &sl->cur_samplerate;
 		break;
 	}
 
@@ -502,7 +601,7 @@ static int set_configuration_samplerate(struct sigrok_device_instance *sdi,
 		g_warning("failed to set samplerate: %d", ret);
 		return SIGROK_ERR;
 	}
-	cur_samplerate = samplerate;
+	((struct saleae_logic *)sdi->priv)->cur_samplerate = samplerate;
 
 	return SIGROK_OK;
 }
@@ -510,23 +609,54 @@ static int set_configuration_samplerate(struct sigrok_device_instance *sdi,
 static int hw_set_configuration(int device_index, int capability, void *value)
 {
 	struct sigrok_device_instance *sdi;
+	struct saleae_logic *sl;
 	int ret;
 	uint64_t *tmp_u64;
 
 	if (!(sdi = get_sigrok_device_instance(device_instances, device_index)))
 		return SIGROK_ERR;
+	sl = sdi->priv;
 
 	if (capability == HWCAP_SAMPLERATE) {
 		tmp_u64 = value;
 		ret = set_configuration_samplerate(sdi, *tmp_u64);
 	} else if (capability == HWCAP_PROBECONFIG) {
-		ret = configure_probes((GSList *) value);
+		ret = configure_probes(sl, (GSList *) value);
 	} else if (capability == HWCAP_TRIGGERCONFIG) {
-		ret = configure_triggers((GSList *) value);
+		ret = configure_triggers(sl, (GSList *) value);
+	} else if (capability == HWCAP_CAPTURE_RATIO) {
+		tmp_u64 = value;
+		if (*tmp_u64 > 100) {
+			ret = SIGROK_ERR;
+		} else {
+			sl->capture_ratio = *tmp_u64;
+			ret = SIGROK_OK;
+		}
 	} else if (capability == HWCAP_LIMIT_SAMPLES) {
 		tmp_u64 = value;
-		limit_samples = *tmp_u64;
+		sl->limit_samples = *tmp_u64;
+		ret = SIGROK_OK;
+	} else if (capability == HWCAP_USB_THREAD) {
+		tmp_u64 = value;
+		sl->use_thread = *tmp_u64 != 0;
 		ret = SIGROK_OK;
+	} else if (capability == HWCAP_USB_TRANSFERS) {
+		tmp_u64 = value;
+		if (*tmp_u64 < 1 || *tmp_u64 > MAX_SIMUL_TRANSFERS) {
+			ret = SIGROK_ERR;
+		} else {
+			sl->num_transfers = *tmp_u64;
+			ret = SIGROK_OK;
+		}
+	} else if (capability == HWCAP_USB_TRANSFER_SIZE) {
+		tmp_u64 = value;
+		if (*tmp_u64 < 1 || *tmp_u64 > MAX_TRANSFER_SIZE) {
+			ret = SIGROK_ERR;
+		} else {
+			sl->transfer_size = (*tmp_u64 + USB_PACKET_SIZE - 1)
+					    & ~(USB_PACKET_SIZE - 1);
+			ret = SIGROK_OK;
+		}
 	} else {
 		ret = SIGROK_ERR;
 	}
@@ -549,26 +679,187 @@ static int receive_data(int fd, int revents, void *user_data)
 	return TRUE;
 }
 
-void receive_transfer(struct libusb_transfer *transfer)
+/*
+ * libusb may open or close fds of its own while running, e.g. for timers.
+ * This is called from the session's thread, so they go to its loop.
+ */
+static void pollfd_added(int fd, short events, void *user_data)
+{
+	/* Avoid compiler warnings. */
+	user_data = user_data;
+
+	source_add(fd, events, 40, receive_data, NULL);
+}
+
+static void pollfd_removed(int fd, void *user_data)
+{
+	/* Avoid compiler warnings. */
+	user_data = user_data;
+
+	source_remove(fd);
+}
+
+/* Keep the latest samples from before the trigger, up to pretrig_size. */
+static void pretrig_append(struct saleae_logic *sl, uint8_t *buf,
+			   uint64_t len)
 {
-	static int num_samples = 0;
-	static int empty_transfer_count = 0;
+	uint64_t chunk;
+
+	if (!sl->pretrig)
+		return;
+
+	/* Only the tail of a big transfer fits. */
+	if (len > sl->pretrig_size) {
+		buf += len - sl->pretrig_size;
+		len = sl->pretrig_size;
+	}
+	while (len) {
+		chunk = MIN(len, sl->pretrig_size - sl->pretrig_pos);
+		memcpy(sl->pretrig + sl->pretrig_pos, buf, chunk);
+		sl->pretrig_pos = (sl->pretrig_pos + chunk) % sl->pretrig_size;
+		sl->pretrig_fill = MIN(sl->pretrig_fill + chunk,
+				       sl->pretrig_size);
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+/*
+ * Send up to pretrig_samples from the pre-trigger buffer, oldest first,
+ * leaving out the last skip samples. Returns the number of samples sent.
+ */
+static uint64_t pretrig_flush(struct saleae_logic *sl, uint64_t skip)
+{
+	struct datafeed_packet packet;
+	uint64_t start, len, chunk, sent;
+
+	if (!sl->pretrig || sl->pretrig_fill <= skip)
+		return 0;
+
+	sent = len = MIN(sl->pretrig_fill - skip, sl->pretrig_samples);
+	start = (sl->pretrig_pos + 2 * sl->pretrig_size - skip - len)
+		% sl->pretrig_size;
+	packet.type = DF_LOGIC;
+	packet.unitsize = 1;
+	packet.buffer = NULL;
+	while (len) {
+		chunk = MIN(len, sl->pretrig_size - start);
+		packet.length = chunk;
+		packet.payload = sl->pretrig + start;
+		session_bus(sl->session_id, &packet);
+		start = (start + chunk) % sl->pretrig_size;
+		len -= chunk;
+	}
+	sl->pretrig_fill = 0;
+
+	return sent;
+}
+
+/* Takes over the reference on pbuf. */
+static void process_transfer(struct sigrok_device_instance *sdi,
+			     struct packet_buffer *cur_pbuf, int cur_buflen)
+{
+	struct saleae_logic *sl;
 	struct datafeed_packet packet;
 	void *user_data;
-	int cur_buflen, trigger_offset, i;
-	unsigned char *cur_buf, *new_buf;
+	int64_t trigger_offset;
+	int num_stages;
+	unsigned char *cur_buf;
+
+	sl = sdi->priv;
+	cur_buf = cur_pbuf->data;
+	user_data = sl->session_id;
+
+	if (cur_buflen == 0) {
+		packet_buffer_unref(cur_pbuf);
+		sl->empty_transfer_count++;
+		if (sl->empty_transfer_count > sl->num_transfers * 2) {
+			/*
+			 * The FX2 gave up. End the acquisition, the frontend
+			 * will work out that the samplecount is short.
+			 */
+			stop_acquisition(sdi);
+		}
+		return;
+	} else {
+		sl->empty_transfer_count = 0;
+	}
+
+	trigger_offset = 0;
+	if (sl->trigger_stage >= 0) {
+		trigger_offset = soft_trigger_run(sl->trigger, cur_buf,
+						  cur_buflen);
+		if (trigger_offset < 0) {
+			/* Still waiting for the trigger. */
+			pretrig_append(sl, cur_buf, cur_buflen);
+			packet_buffer_unref(cur_pbuf);
+			return;
+		}
+		num_stages = sl->trigger->num_stages;
+
+		/*
+		 * Send what led up to the trigger. The samples that matched
+		 * are sent after DF_TRIGGER, so leave them out.
+		 */
+		pretrig_append(sl, cur_buf, trigger_offset);
+		sl->num_samples += pretrig_flush(sl, num_stages) + num_stages;
+
+		/* Mark the trigger point. */
+		packet.type = DF_TRIGGER;
+		packet.length = 0;
+		packet.unitsize = 0;
+		packet.payload = NULL;
+		packet.buffer = NULL;
+		session_bus(user_data, &packet);
+
+		/*
+		 * Send the samples that triggered it, since we're skipping
+		 * past them.
+		 */
+		packet.type = DF_LOGIC;
+		packet.length = num_stages;
+		packet.unitsize = 1;
+		packet.payload = sl->trigger->matched;
+		packet.buffer = NULL;
+		session_bus(user_data, &packet);
+
+		sl->trigger_stage = TRIGGER_FIRED;
+	}
 
-	/* hw_stop_acquisition() is telling us to stop. */
-	if (transfer == NULL)
-		num_samples = -1;
+	/* Send the incoming transfer to the session bus. */
+	packet.type = DF_LOGIC;
+	packet.length = cur_buflen - trigger_offset;
+	packet.unitsize = 1;
+	packet.payload = cur_buf + trigger_offset;
+	packet.buffer = cur_pbuf;
+	session_bus(user_data, &packet);
+
+	sl->num_samples += cur_buflen - trigger_offset;
+	if (sl->limit_samples && sl->num_samples > sl->limit_samples)
+		stop_acquisition(sdi);
+	packet_buffer_unref(cur_pbuf);
+}
+
+void receive_transfer(struct libusb_transfer *transfer)
+{
+	struct sigrok_device_instance *sdi;
+	struct saleae_logic *sl;
+	struct packet_buffer *cur_pbuf, *new_pbuf;
+	struct done_transfer *done;
+	int cur_buflen;
+	gint head;
+
+	sdi = transfer->user_data;
+	sl = sdi->priv;
+	sl->transfers_pending--;
 
 	/*
 	 * If acquisition has already ended, just free any queued up
 	 * transfer that come in.
 	 */
-	if (num_samples == -1) {
-		if (transfer)
-			libusb_free_transfer(transfer);
+	if (g_atomic_int_get(&sl->ended)) {
+		packet_buffer_unref(packet_buffer_from_data(transfer->buffer));
+		libusb_free_transfer(transfer);
 		return;
 	}
 
@@ -576,156 +867,224 @@ void receive_transfer(struct libusb_transfer *transfer)
 		  transfer->status, transfer->actual_length);
 
 	/* Save incoming transfer before reusing the transfer struct. */
-	cur_buf = transfer->buffer;
 	cur_buflen = transfer->actual_length;
-	user_data = transfer->user_data;
+	cur_pbuf = packet_buffer_from_data(transfer->buffer);
 
-	/* Fire off a new request. */
-	new_buf = g_malloc(4096);
-	transfer->buffer = new_buf;
-	transfer->length = 4096;
-	if (libusb_submit_transfer(transfer) != 0) {
+	/* The FX2 had nowhere to put samples until now. */
+	if (sl->transfers_pending == 0)
+		sl->late_resubmits++;
+
+	/* Fire off a new request, with a buffer from the pool. */
+	if (!(new_pbuf = packet_buffer_new(sl->cur_transfer_size))) {
 		/* TODO: Stop session? */
-		g_warning("eek");
+		sl->failed_resubmits++;
+		libusb_free_transfer(transfer);
+	} else {
+		transfer->buffer = new_pbuf->data;
+		transfer->length = sl->cur_transfer_size;
+		if (libusb_submit_transfer(transfer) != 0) {
+			/* TODO: Stop session? */
+			sl->failed_resubmits++;
+			packet_buffer_unref(new_pbuf);
+			libusb_free_transfer(transfer);
+		} else {
+			sl->transfers_pending++;
+		}
 	}
 
-	if (cur_buflen == 0) {
-		empty_transfer_count++;
-		if (empty_transfer_count > MAX_EMPTY_TRANSFERS) {
-			/*
-			 * The FX2 gave up. End the acquisition, the frontend
-			 * will work out that the samplecount is short.
-			 */
-			hw_stop_acquisition(-1, user_data);
-		}
+	if (!sl->use_thread) {
+		process_transfer(sdi, cur_pbuf, cur_buflen);
 		return;
-	} else {
-		empty_transfer_count = 0;
 	}
 
-	trigger_offset = 0;
-	if (trigger_stage >= 0) {
-		for (i = 0; i < cur_buflen; i++) {
-
-			if ((cur_buf[i] & trigger_mask[trigger_stage]) == trigger_value[trigger_stage]) {
-				/* Match on this trigger stage. */
-				trigger_buffer[trigger_stage] = cur_buf[i];
-				trigger_stage++;
-				if (trigger_stage == NUM_TRIGGER_STAGES || trigger_mask[trigger_stage] == 0) {
-					/* Match on all trigger stages, we're done. */
-					trigger_offset = i + 1;
-
-					/*
-					 * TODO: Send pre-trigger buffer to session bus.
-					 * Tell the frontend we hit the trigger here.
-					 */
-					packet.type = DF_TRIGGER;
-					packet.length = 0;
-					session_bus(user_data, &packet);
-
-					/*
-					 * Send the samples that triggered it, since we're
-					 * skipping past them.
-					 */
-					packet.type = DF_LOGIC;
-					packet.length = trigger_stage;
-					packet.unitsize = 1;
-					packet.payload = trigger_buffer;
-					session_bus(user_data, &packet);
-
-					trigger_stage = TRIGGER_FIRED;
-					break;
-				}
-				return;
-			}
+	/* Leave the rest to the session, the FX2 can't wait for it. */
+	head = sl->done_head;
+	if ((guint)(head - g_atomic_int_get(&sl->done_tail))
+	    >= TRANSFER_QUEUE_LEN) {
+		sl->done_overruns++;
+		packet_buffer_unref(cur_pbuf);
+		return;
+	}
+	done = &sl->done[head & (TRANSFER_QUEUE_LEN - 1)];
+	done->pbuf = cur_pbuf;
+	done->length = cur_buflen;
+	g_atomic_int_set(&sl->done_head, head + 1);
+}
 
-			/*
-			 * We had a match before, but not in the next sample. However, we may
-			 * have a match on this stage in the next bit -- trigger on 0001 will
-			 * fail on seeing 00001, so we need to go back to stage 0 -- but at
-			 * the next sample from the one that matched originally, which the
-			 * counter increment at the end of the loop takes care of.
-			 */
-			if (trigger_stage > 0) {
-				i -= trigger_stage;
-				if (i < -1)
-					i = -1; /* Oops, went back past this buffer. */
-				/* Reset trigger stage. */
-				trigger_stage = 0;
-			}
+/* Runs in the session's thread, with the USB thread's transfers. */
+static int receive_queued(int fd, int revents, void *user_data)
+{
+	struct sigrok_device_instance *sdi;
+	struct saleae_logic *sl;
+	struct done_transfer done;
+	gint tail;
 
+	/* Avoid compiler warnings. */
+	fd = fd;
+	revents = revents;
 
-		}
+	sdi = user_data;
+	sl = sdi->priv;
+	tail = sl->done_tail;
+	while (!g_atomic_int_get(&sl->ended)
+	       && tail != g_atomic_int_get(&sl->done_head)) {
+		done = sl->done[tail & (TRANSFER_QUEUE_LEN - 1)];
+		g_atomic_int_set(&sl->done_tail, ++tail);
+		process_transfer(sdi, done.pbuf, done.length);
 	}
 
-	if (trigger_stage == TRIGGER_FIRED) {
-		/* Send the incoming transfer to the session bus. */
-		packet.type = DF_LOGIC;
-		packet.length = cur_buflen - trigger_offset;
-		packet.unitsize = 1;
-		packet.payload = cur_buf + trigger_offset;
-		session_bus(user_data, &packet);
-		g_free(cur_buf);
+	return TRUE;
+}
 
-		num_samples += cur_buflen;
-		if (limit_samples && (unsigned int) num_samples > limit_samples) {
-			hw_stop_acquisition(-1, user_data);
-		}
-	} else {
-		/*
-		 * TODO: Buffer pre-trigger data in capture
-		 * ratio-sized buffer.
-		 */
+/* The USB thread only handles events, any real work is queued. */
+static gpointer usb_thread(gpointer data)
+{
+	struct saleae_logic *sl;
+	struct timeval tv;
+#ifdef _POSIX_THREAD_PRIORITY_SCHEDULING
+	struct sched_param param;
+
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+		g_message("saleae: no real-time priority for USB thread");
+#endif
+
+	sl = data;
+	while (!g_atomic_int_get(&sl->thread_quit)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		libusb_handle_events_timeout(usb_context, &tv);
 	}
+
+	return NULL;
+}
+
+static void stop_usb_thread(struct saleae_logic *sl)
+{
+	gint tail;
+
+	if (!sl->usb_thread)
+		return;
+
+	g_atomic_int_set(&sl->thread_quit, 1);
+	g_thread_join(sl->usb_thread);
+	sl->usb_thread = NULL;
+
+	/* Whatever the session didn't get to. */
+	for (tail = sl->done_tail; tail != sl->done_head; tail++)
+		packet_buffer_unref(
+			sl->done[tail & (TRANSFER_QUEUE_LEN - 1)].pbuf);
+	sl->done_tail = tail;
+
+	if (sl->done_overruns)
+		g_warning("saleae: dropped %u transfers, the session "
+			  "fell behind", sl->done_overruns);
 }
 
 static int hw_start_acquisition(int device_index, gpointer session_device_id)
 {
 	struct sigrok_device_instance *sdi;
+	struct saleae_logic *sl;
 	struct datafeed_packet *packet;
 	struct datafeed_header *header;
 	struct libusb_transfer *transfer;
 	const struct libusb_pollfd **lupfd;
+	struct packet_buffer *pbuf;
 	int size, i;
-	unsigned char *buf;
 
 	if (!(sdi = get_sigrok_device_instance(device_instances, device_index)))
 		return SIGROK_ERR;
 
+	sl = sdi->priv;
+	sl->session_id = session_device_id;
+	sl->num_samples = 0;
+	g_atomic_int_set(&sl->ended, 0);
+	sl->empty_transfer_count = 0;
+	sl->done_head = sl->done_tail = 0;
+	sl->done_overruns = 0;
+	sl->transfers_pending = 0;
+
+	/* Arm the trigger again, if there is one. */
+	sl->trigger_stage = TRIGGER_FIRED;
+	if (sl->trigger) {
+		soft_trigger_reset(sl->trigger);
+		sl->trigger_stage = 0;
+	}
+	sl->pretrig_samples = MIN(sl->limit_samples * sl->capture_ratio / 100,
+				  MAX_PRETRIGGER);
+	sl->pretrig_size = sl->pretrig_samples + NUM_TRIGGER_STAGES;
+	sl->pretrig_pos = sl->pretrig_fill = 0;
+	if (sl->trigger_stage != TRIGGER_FIRED && sl->pretrig_samples) {
+		if (!(sl->pretrig = g_try_malloc(sl->pretrig_size))) {
+			g_warning("saleae: out of memory for pre-trigger "
+				  "buffer");
+			return SIGROK_ERR_MALLOC;
+		}
+	}
+	sl->late_resubmits = sl->failed_resubmits = 0;
+	if (!sl->num_transfers)
+		sl->num_transfers = NUM_SIMUL_TRANSFERS;
+	if (!(size = sl->transfer_size)) {
+		size = sl->cur_samplerate / 1000 * TRANSFER_MSEC;
+		size = (size + USB_PACKET_SIZE - 1) & ~(USB_PACKET_SIZE - 1);
+		size = CLAMP(size, MIN_TRANSFER_SIZE, MAX_TRANSFER_SIZE);
+	}
+	sl->cur_transfer_size = size;
+	/* Time for the FX2 to fill one, with plenty of slack. */
+	sl->transfer_timeout = 40 + size * 2000ULL / sl->cur_samplerate;
+
 	packet = g_malloc(sizeof(struct datafeed_packet));
 	header = g_malloc(sizeof(struct datafeed_header));
 	if (!packet || !header)
 		return SIGROK_ERR;
 
-	/* Start with 2K transfer, subsequently increased to 4K. */
-	size = 2048;
-	for (i = 0; i < NUM_SIMUL_TRANSFERS; i++) {
-		buf = g_malloc(size);
+	/*
+	 * Have the pool hold the transfers' buffers up front. Buffers come
+	 * back to it as outputs are done with them, and get reused.
+	 */
+	if (packet_buffer_pool_prealloc(size, sl->num_transfers) != SIGROK_OK)
+		g_message("saleae: couldn't preallocate transfer buffers");
+
+	for (i = 0; i < sl->num_transfers; i++) {
+		if (!(pbuf = packet_buffer_new(size)))
+			return SIGROK_ERR_MALLOC;
 		transfer = libusb_alloc_transfer(0);
 		libusb_fill_bulk_transfer(transfer, sdi->usb->devhdl,
-				2 | LIBUSB_ENDPOINT_IN, buf, size,
-				receive_transfer, session_device_id, 40);
+				2 | LIBUSB_ENDPOINT_IN, pbuf->data, size,
+				receive_transfer, sdi, sl->transfer_timeout);
 		if (libusb_submit_transfer(transfer) != 0) {
 			/* TODO: Free them all. */
 			libusb_free_transfer(transfer);
-			g_free(buf);
+			packet_buffer_unref(pbuf);
 			return SIGROK_ERR;
 		}
-		size = 4096;
+		sl->transfers_pending++;
 	}
 
-	lupfd = libusb_get_pollfds(usb_context);
-	for (i = 0; lupfd[i]; i++)
-		source_add(lupfd[i]->fd, lupfd[i]->events, 40, receive_data,
-			   NULL);
-	free(lupfd);
+	if (sl->use_thread) {
+		sl->thread_quit = 0;
+		if (!(sl->usb_thread = g_thread_create(usb_thread, sl, TRUE,
+						       NULL))) {
+			g_warning("saleae: failed to start USB thread");
+			return SIGROK_ERR;
+		}
+		source_add(-1, 0, TRANSFER_QUEUE_POLL, receive_queued, sdi);
+	} else {
+		lupfd = libusb_get_pollfds(usb_context);
+		for (i = 0; lupfd[i]; i++)
+			source_add(lupfd[i]->fd, lupfd[i]->events, 40,
+				   receive_data, NULL);
+		free(lupfd);
+		libusb_set_pollfd_notifiers(usb_context, pollfd_added,
+					    pollfd_removed, NULL);
+	}
 
 	packet->type = DF_HEADER;
 	packet->length = sizeof(struct datafeed_header);
 	packet->payload = (unsigned char *)header;
 	header->feed_version = 1;
 	gettimeofday(&header->starttime, NULL);
-	header->samplerate = cur_samplerate;
+	header->samplerate = sl->cur_samplerate;
 	header->protocol_id = PROTO_RAW;
 	header->num_logic_probes = NUM_PROBES;
 	header->num_analog_probes = 0;
@@ -736,22 +1095,49 @@ static int hw_start_acquisition(int device_index, gpointer session_device_id)
 	return SIGROK_OK;
 }
 
-/* This stops acquisition on ALL devices, ignoring device_index. */
-static void hw_stop_acquisition(int device_index, gpointer session_device_id)
+static void stop_acquisition(struct sigrok_device_instance *sdi)
 {
+	struct saleae_logic *sl;
 	struct datafeed_packet packet;
 
-	/* Avoid compiler warnings. */
-	device_index = device_index;
+	sl = sdi->priv;
+	if (g_atomic_int_get(&sl->ended))
+		return;
 
 	packet.type = DF_END;
-	session_bus(session_device_id, &packet);
-
-	receive_transfer(NULL);
+	packet.length = 0;
+	packet.unitsize = 0;
+	packet.payload = NULL;
+	packet.buffer = NULL;
+	session_bus(sl->session_id, &packet);
+
+	/* Transfers still coming in are freed by receive_transfer(). */
+	g_atomic_int_set(&sl->ended, 1);
+	stop_usb_thread(sl);
+	g_free(sl->pretrig);
+	sl->pretrig = NULL;
+
+	if (sl->late_resubmits)
+		g_warning("saleae: %u transfers resubmitted late, samples "
+			  "may have been lost", sl->late_resubmits);
+	if (sl->failed_resubmits)
+		g_warning("saleae: failed to resubmit %u transfers",
+			  sl->failed_resubmits);
 
 	/* TODO: Need to cancel and free any queued up transfers. */
 }
 
+static void hw_stop_acquisition(int device_index, gpointer session_device_id)
+{
+	struct sigrok_device_instance *sdi;
+
+	/* Avoid compiler warnings. */
+	session_device_id = session_device_id;
+
+	if ((sdi = get_sigrok_device_instance(device_instances, device_index)))
+		stop_acquisition(sdi);
+}
+
 struct device_plugin saleae_logic_plugin_info = {
 	"saleae-logic",
 	1,
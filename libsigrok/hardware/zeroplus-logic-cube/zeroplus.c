@@ -506,6 +506,7 @@ static int hw_start_acquisition(int device_index, gpointer session_device_id)
 	struct datafeed_header header;
 	int res;
 	unsigned int packet_num;
+	struct packet_buffer *pbuf;
 	unsigned char *buf;
 
 	if (!(sdi = get_sigrok_device_instance(device_instances, device_index)))
@@ -536,13 +537,14 @@ static int hw_start_acquisition(int device_index, gpointer session_device_id)
 	header.num_analog_probes = 0;
 	session_bus(session_device_id, &packet);
 
-	buf = g_malloc(PACKET_SIZE);
-	if (!buf)
-		return SIGROK_ERR;
 	analyzer_read_start(sdi->usb->devhdl);
 	/* Send the incoming transfer to the session bus. */
 	for (packet_num = 0; packet_num < (memory_size * 4 / PACKET_SIZE);
 	     packet_num++) {
+		/* Every packet gets its own (recycled) buffer. */
+		if (!(pbuf = packet_buffer_new(PACKET_SIZE)))
+			break;
+		buf = pbuf->data;
 		res = analyzer_read_data(sdi->usb->devhdl, buf, PACKET_SIZE);
 #if 0
 		g_message("Tried to read %llx bytes, actually read %x bytes",
@@ -553,10 +555,11 @@ static int hw_start_acquisition(int device_index, gpointer session_device_id)
 		packet.length = PACKET_SIZE;
 		packet.unitsize = 4;
 		packet.payload = buf;
+		packet.buffer = pbuf;
 		session_bus(session_device_id, &packet);
+		packet_buffer_unref(pbuf);
 	}
 	analyzer_read_stop(sdi->usb->devhdl);
-	g_free(buf);
 
 	packet.type = DF_END;
 	session_bus(session_device_id, &packet);
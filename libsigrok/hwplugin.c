@@ -26,9 +26,6 @@
 #include <sigrok.h>
 #include "config.h"
 
-source_callback_add source_cb_add = NULL;
-source_callback_remove source_cb_remove = NULL;
-
 /* The list of loaded plugins lives here. */
 GSList *plugins;
 
@@ -40,6 +37,9 @@ struct hwcap_option hwcap_options[] = {
 	{HWCAP_SAMPLERATE, T_UINT64, "Sample rate", "samplerate"},
 	{HWCAP_CAPTURE_RATIO, T_UINT64, "Pre-trigger capture ratio", "captureratio"},
 	{HWCAP_PATTERN_MODE, T_CHAR, "Pattern generator mode", "patternmode"},
+	{HWCAP_USB_THREAD, T_UINT64, "USB event thread", "usbthread"},
+	{HWCAP_USB_TRANSFERS, T_UINT64, "USB transfers in flight", "transfers"},
+	{HWCAP_USB_TRANSFER_SIZE, T_UINT64, "USB transfer size", "transfersize"},
 	{0, 0, NULL, NULL},
 };
 
@@ -217,15 +217,33 @@ struct hwcap_option *find_hwcap_option(int hwcap)
 	return NULL;
 }
 
+/* Drivers' sources go to the session they are being called from. */
 void source_remove(int fd)
 {
-	if (source_cb_remove)
-		source_cb_remove(fd);
+	struct session *session;
+
+	if ((session = session_current()))
+		session_source_remove(session, fd, NULL, NULL);
+}
+
+/* For sources on negative fds, which several devices may share. */
+void source_remove_callback(int fd, receive_data_callback rcv_cb,
+			    void *user_data)
+{
+	struct session *session;
+
+	if ((session = session_current()))
+		session_source_remove(session, fd, rcv_cb, user_data);
 }
 
 void source_add(int fd, int events, int timeout, receive_data_callback rcv_cb,
 		void *user_data)
 {
-	if (source_cb_add)
-		source_cb_add(fd, events, timeout, rcv_cb, user_data);
+	struct session *session;
+
+	if (!(session = session_current())) {
+		g_warning("source added outside of a session");
+		return;
+	}
+	session_source_add(session, fd, events, timeout, rcv_cb, user_data);
 }
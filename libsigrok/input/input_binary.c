@@ -60,7 +60,7 @@ static int loadfile(struct input *in, const char *filename)
 {
 	struct datafeed_header header;
 	struct datafeed_packet packet;
-	char buffer[CHUNKSIZE];
+	struct packet_buffer *buf;
 	int fd, size, num_probes;
 
 	if ((fd = open(filename, O_RDONLY)) == -1)
@@ -83,10 +83,16 @@ static int loadfile(struct input *in, const char *filename)
 	/* chop up the input file into chunks and feed it into the session bus */
 	packet.type = DF_LOGIC;
 	packet.unitsize = (num_probes + 7) / 8;
-	packet.payload = buffer;
-	while ((size = read(fd, buffer, CHUNKSIZE)) > 0) {
+	while ((buf = packet_buffer_new(CHUNKSIZE))) {
+		if ((size = read(fd, buf->data, CHUNKSIZE)) <= 0) {
+			packet_buffer_unref(buf);
+			break;
+		}
 		packet.length = size;
+		packet.payload = buf->data;
+		packet.buffer = buf;
 		session_bus(in->vdevice, &packet);
+		packet_buffer_unref(buf);
 	}
 	close(fd);
 
@@ -21,59 +21,237 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <zip.h>
 #include <sigrok.h>
 
-/* There can only be one session at a time. */
-struct session *session;
+/*
+ * Raw data is saved in blocks of this many units, each one a separately
+ * compressed member of the archive. Matching the datastore chunk size means
+ * every block can be read straight out of a single chunk.
+ */
+#define SESSION_BLOCK_UNITS	DATASTORE_CHUNKSIZE
 
-struct session *session_load(const char *filename)
-{
-	struct session *session;
+/* State for a zip source reading units straight out of a datastore. */
+struct datastore_zip_source {
+	struct datastore *ds;
+	/* First unit and number of units to store */
+	uint64_t start;
+	uint64_t count;
+	/* Current read position, in bytes */
+	uint64_t pos;
+};
 
-	/* Avoid compiler warnings. */
-	filename = filename;
+/* Longest a bus queue's consumer or producer sleeps between checks, in us */
+#define BUS_QUEUE_WAIT		10000
 
-	/* TODO: Implement. */
-	session = NULL;
+/* Packets queued for the protocol analyzers, unless the bus sets a length */
+#define PA_QUEUE_LEN		64
 
-	return session;
-}
+/* A packet waiting in a threaded bus queue. */
+struct bus_item {
+	struct device *device;
+	struct datafeed_packet packet;
+};
 
+/*
+ * In threaded bus mode every datafeed callback gets one of these, and the
+ * protocol analyzers get one if there are any: a ring of packets written
+ * by session_bus() and read by the consumer's own thread. head and tail
+ * are free-running counters, only written by the producer and consumer
+ * respectively -- except for BUS_QUEUE_DROP_OLDEST, where the producer
+ * may also move tail forward. Both sides claim an item by a
+ * compare-and-swap on tail, so whoever loses simply forgets about it.
+ */
+struct bus_queue {
+	datafeed_callback cb;
+	struct bus_item *items;
+	/* Number of items, a power of two */
+	unsigned int size;
+	/* What to do when full, BUS_QUEUE_* */
+	int policy;
+	volatile guint head;
+	volatile guint tail;
+	volatile gint quit;
+	/* Only used to sleep when the queue is empty or full */
+	GMutex *mutex;
+	GCond *cond;
+	volatile gint waiting;
+	GThread *thread;
+	uint64_t overruns;
+};
+
+/* Data a frontend keeps for a device, for as long as the session lasts. */
+struct device_context {
+	void *data;
+	GDestroyNotify destroy;
+};
+
+/*
+ * Trigger state the session keeps for a device. trigger is one the device's
+ * driver can't handle: session_bus() runs it on the device's samples, or
+ * for protocol triggers, the analyzer thread on the analyzers' output. The
+ * evaluator is made once the unit size is known, and the trigger fires
+ * once per acquisition.
+ *
+ * With a pre-trigger length set, session_bus_dispatch() holds back the
+ * device's samples until a DF_TRIGGER comes by, from the driver or the
+ * session, keeping only the last ones in held.
+ */
+struct bus_trigger {
+	struct trigger *trigger;
+	struct soft_trigger *soft;
+	uint64_t samplerate;
+	gboolean done;
+	/* Held struct datafeed_packet*, and how many samples they have */
+	GQueue *held;
+	uint64_t held_samples;
+	gboolean waiting;
+};
+
+static void bus_queues_stop(struct session *session);
+
+/*
+ * Sessions are independent of each other, so a frontend may run several at
+ * once, each from a thread of its own if it likes.
+ */
 struct session *session_new(void)
 {
-	session = calloc(1, sizeof(struct session));
+	struct session *session;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if (!(session = g_try_malloc0(sizeof(struct session))))
+		return NULL;
+	session->mutex = g_mutex_new();
+	session->bus_mutex = g_mutex_new();
+	session->pa_mutex = g_mutex_new();
 
 	return session;
 }
 
-void session_destroy(void)
+void session_destroy(struct session *session)
 {
+	GSList *l;
+
+	bus_queues_stop(session);
+	for (l = session->devices; l; l = l->next)
+		((struct device *)l->data)->session = NULL;
 	g_slist_free(session->devices);
+	if (session->device_contexts)
+		g_hash_table_destroy(session->device_contexts);
+	if (session->pa_positions)
+		g_hash_table_destroy(session->pa_positions);
+	if (session->triggers)
+		g_hash_table_destroy(session->triggers);
 
 	/* TODO: Loop over protocols and free them. */
 
+	if (session->loop)
+		session_loop_free(session->loop);
+	if (session->file)
+		session_file_free(session->file);
+	g_mutex_free(session->mutex);
+	g_mutex_free(session->bus_mutex);
+	g_mutex_free(session->pa_mutex);
 	g_free(session);
 }
 
-void session_device_clear(void)
+void session_device_clear(struct session *session)
 {
+	GSList *l;
+
+	g_mutex_lock(session->mutex);
+	for (l = session->devices; l; l = l->next)
+		((struct device *)l->data)->session = NULL;
 	g_slist_free(session->devices);
 	session->devices = NULL;
+	g_mutex_unlock(session->mutex);
 }
 
-int session_device_add(struct device *device)
+/*
+ * A device can only be in one session at a time. Devices without a plugin,
+ * such as an input file's, have nothing to open but still need to be added
+ * to send packets on the session's bus.
+ */
+int session_device_add(struct session *session, struct device *device)
 {
 	int ret;
 
-	ret = device->plugin->open(device->plugin_index);
-	if (ret == SIGROK_OK)
+	if (device->session)
+		return SIGROK_ERR;
+
+	ret = SIGROK_OK;
+	if (device->plugin)
+		ret = device->plugin->open(device->plugin_index);
+	if (ret == SIGROK_OK) {
+		g_mutex_lock(session->mutex);
+		device->session = session;
 		session->devices = g_slist_append(session->devices, device);
+		g_mutex_unlock(session->mutex);
+	}
 
 	return ret;
 }
 
-void session_pa_clear(void)
+static void device_context_free(gpointer data)
+{
+	struct device_context *ctx;
+
+	ctx = data;
+	if (ctx->destroy)
+		ctx->destroy(ctx->data);
+	g_free(ctx);
+}
+
+/*
+ * Attach the frontend's own state to a device, e.g. whatever a datafeed
+ * callback needs to handle that device's packets. It is handed to destroy,
+ * if given, when replaced or when the session is destroyed.
+ */
+int session_device_context_set(struct device *device, void *data,
+			       GDestroyNotify destroy)
+{
+	struct session *session;
+	struct device_context *ctx;
+
+	if (!(session = device->session))
+		return SIGROK_ERR;
+
+	ctx = g_malloc0(sizeof(struct device_context));
+	ctx->data = data;
+	ctx->destroy = destroy;
+
+	g_mutex_lock(session->mutex);
+	if (!session->device_contexts)
+		session->device_contexts = g_hash_table_new_full(
+			g_direct_hash, g_direct_equal, NULL,
+			device_context_free);
+	g_hash_table_insert(session->device_contexts, device, ctx);
+	g_mutex_unlock(session->mutex);
+
+	return SIGROK_OK;
+}
+
+void *session_device_context_get(struct device *device)
+{
+	struct session *session;
+	struct device_context *ctx;
+
+	if (!(session = device->session))
+		return NULL;
+
+	g_mutex_lock(session->mutex);
+	ctx = NULL;
+	if (session->device_contexts)
+		ctx = g_hash_table_lookup(session->device_contexts, device);
+	g_mutex_unlock(session->mutex);
+
+	return ctx ? ctx->data : NULL;
+}
+
+void session_pa_clear(struct session *session)
 {
 	/*
 	 * The protocols are pointers to the global set of PA plugins,
@@ -83,73 +261,829 @@ void session_pa_clear(void)
 	session->analyzers = NULL;
 }
 
-void session_pa_add(struct analyzer *an)
+/*
+ * Analyzers get every packet on the bus, in order, from a thread of their
+ * own, and whatever their decode() returns goes out on the bus as DF_PD.
+ */
+void session_pa_add(struct session *session, struct analyzer *an)
 {
 	session->analyzers = g_slist_append(session->analyzers, an);
 }
 
-void session_datafeed_callback_clear(void)
+void session_datafeed_callback_clear(struct session *session)
 {
 	g_slist_free(session->datafeed_callbacks);
 	session->datafeed_callbacks = NULL;
 }
 
-void session_datafeed_callback_add(datafeed_callback callback)
+void session_datafeed_callback_add(struct session *session,
+				    datafeed_callback callback)
 {
 	session->datafeed_callbacks =
 	    g_slist_append(session->datafeed_callbacks, callback);
 }
 
-int session_start(void)
+/*
+ * Deliver packets to every datafeed callback from a thread of its own,
+ * through a queue of queue_len packets, instead of calling it from
+ * session_bus(). A slow callback then no longer holds up the driver.
+ * policy says what happens when a queue is full; DF_HEADER, DF_END and
+ * DF_TRIGGER packets are never dropped though. A queue_len of 0 goes back
+ * to calling the callbacks directly. This can't be changed while packets
+ * are flowing.
+ */
+int session_bus_threaded(struct session *session, unsigned int queue_len,
+			 int policy)
+{
+	unsigned int size;
+
+	if (session->bus_queues)
+		return SIGROK_ERR;
+
+	if (policy != BUS_QUEUE_BLOCK && policy != BUS_QUEUE_DROP_OLDEST
+	    && policy != BUS_QUEUE_DROP_NEWEST)
+		return SIGROK_ERR;
+
+	/* Round up to a power of two, so the counters can wrap. */
+	for (size = queue_len ? 1 : 0; size && size < queue_len; size <<= 1)
+		;
+	session->bus_queue_len = size;
+	session->bus_policy = policy;
+
+	return SIGROK_OK;
+}
+
+/* Number of packets dropped so far in threaded bus mode. */
+uint64_t session_bus_overruns(struct session *session)
+{
+	struct bus_queue *q;
+	uint64_t overruns;
+	GSList *l;
+
+	overruns = session->bus_overruns;
+	for (l = session->bus_queues; l; l = l->next) {
+		q = l->data;
+		overruns += q->overruns;
+	}
+
+	return overruns;
+}
+
+/*
+ * Only pass on samples from a trigger on, plus the given number of samples
+ * from before it, for every device in the session. Takes effect on the next
+ * session_start().
+ */
+void session_pretrigger_set(struct session *session, uint64_t samples)
+{
+	session->pretrigger = samples;
+}
+
+static int is_control_packet(struct datafeed_packet *packet)
+{
+	return packet->type == DF_HEADER || packet->type == DF_END
+	       || packet->type == DF_TRIGGER;
+}
+
+/* Wake up the other side of the queue, if it's sleeping. */
+static void bus_queue_wake(struct bus_queue *q)
+{
+	if (g_atomic_int_get(&q->waiting)) {
+		g_mutex_lock(q->mutex);
+		g_cond_signal(q->cond);
+		g_mutex_unlock(q->mutex);
+	}
+}
+
+/*
+ * head and tail wrap around on long captures, so they are unsigned and only
+ * ever compared by subtraction. GLib's atomics take a gint.
+ */
+static inline guint bus_counter_get(volatile guint *counter)
+{
+	return g_atomic_int_get((volatile gint *)counter);
+}
+
+static inline void bus_counter_set(volatile guint *counter, guint value)
+{
+	g_atomic_int_set((volatile gint *)counter, (gint)value);
+}
+
+/* Move counter from value to value + 1, unless someone else did first. */
+static inline gboolean bus_counter_claim(volatile guint *counter, guint value)
+{
+	return g_atomic_int_compare_and_exchange((volatile gint *)counter,
+						 (gint)value,
+						 (gint)(value + 1));
+}
+
+/*
+ * Sleep until woken up by the other side, or for BUS_QUEUE_WAIT at most.
+ * The caller's condition is checked again with waiting set, so a wakeup
+ * can't slip in between.
+ */
+static void bus_queue_sleep(struct bus_queue *q, gboolean for_space)
+{
+	GTimeVal timeout;
+	guint used;
+
+	g_mutex_lock(q->mutex);
+	g_atomic_int_set(&q->waiting, 1);
+	used = bus_counter_get(&q->head) - bus_counter_get(&q->tail);
+	if (for_space ? used >= q->size
+		      : (used == 0 && !g_atomic_int_get(&q->quit))) {
+		g_get_current_time(&timeout);
+		g_time_val_add(&timeout, BUS_QUEUE_WAIT);
+		g_cond_timed_wait(q->cond, q->mutex, &timeout);
+	}
+	g_atomic_int_set(&q->waiting, 0);
+	g_mutex_unlock(q->mutex);
+}
+
+static gpointer bus_queue_thread(gpointer data)
+{
+	struct bus_queue *q;
+	struct bus_item item;
+	guint tail;
+
+	q = data;
+	while (TRUE) {
+		tail = bus_counter_get(&q->tail);
+		if (tail == bus_counter_get(&q->head)) {
+			if (g_atomic_int_get(&q->quit))
+				break;
+			bus_queue_sleep(q, FALSE);
+			continue;
+		}
+
+		/*
+		 * Copy first, claim after: if the producer dropped the item
+		 * meanwhile, the slot may hold garbage, but the claim fails.
+		 */
+		item = q->items[tail & (q->size - 1)];
+		if (!bus_counter_claim(&q->tail, tail))
+			/* Dropped by the producer while we copied it. */
+			continue;
+		bus_queue_wake(q);
+
+		q->cb(item.device, &item.packet);
+		if (item.packet.buffer)
+			packet_buffer_unref(item.packet.buffer);
+	}
+
+	return NULL;
+}
+
+/* Queue a packet whose payload, if any, is in a pooled buffer. */
+static void bus_queue_push(struct bus_queue *q, struct device *device,
+			   struct datafeed_packet *packet)
+{
+	struct bus_item *item;
+	guint head, tail;
+
+	head = q->head;
+	while (TRUE) {
+		tail = bus_counter_get(&q->tail);
+		if (head - tail < q->size)
+			break;
+
+		if (is_control_packet(packet) || q->policy == BUS_QUEUE_BLOCK) {
+			bus_queue_sleep(q, TRUE);
+		} else if (q->policy == BUS_QUEUE_DROP_NEWEST) {
+			q->overruns++;
+			return;
+		} else {
+			item = &q->items[tail & (q->size - 1)];
+			if (is_control_packet(&item->packet)) {
+				/* Only samples are dropped. */
+				bus_queue_sleep(q, TRUE);
+			} else if (bus_counter_claim(&q->tail, tail)) {
+				if (item->packet.buffer)
+					packet_buffer_unref(
+						item->packet.buffer);
+				q->overruns++;
+			}
+		}
+	}
+
+	item = &q->items[head & (q->size - 1)];
+	item->device = device;
+	item->packet = *packet;
+	if (packet->buffer)
+		packet_buffer_ref(packet->buffer);
+	bus_counter_set(&q->head, head + 1);
+	bus_queue_wake(q);
+}
+
+/* size must be a power of two. The thread is started right away. */
+static struct bus_queue *bus_queue_new(datafeed_callback cb,
+				       unsigned int size, int policy)
+{
+	struct bus_queue *q;
+
+	q = g_malloc0(sizeof(struct bus_queue));
+	q->cb = cb;
+	q->size = size;
+	q->policy = policy;
+	q->items = g_malloc0(q->size * sizeof(struct bus_item));
+	q->mutex = g_mutex_new();
+	q->cond = g_cond_new();
+	q->thread = g_thread_create(bus_queue_thread, q, TRUE, NULL);
+
+	return q;
+}
+
+/* Let the consumer finish everything that's queued, and stop it. */
+static void bus_queue_destroy(struct session *session,
+			      struct bus_queue *q)
+{
+	if (q->thread) {
+		g_atomic_int_set(&q->quit, 1);
+		bus_queue_wake(q);
+		g_thread_join(q->thread);
+	}
+	if (q->overruns)
+		g_warning("datafeed callback dropped %" PRIu64 " packets",
+			  q->overruns);
+	session->bus_overruns += q->overruns;
+	g_mutex_free(q->mutex);
+	g_cond_free(q->cond);
+	g_free(q->items);
+	g_free(q);
+}
+
+static int bus_queues_start(struct session *session)
+{
+	struct bus_queue *q;
+	GSList *l;
+
+	for (l = session->datafeed_callbacks; l; l = l->next) {
+		q = bus_queue_new(l->data, session->bus_queue_len,
+				  session->bus_policy);
+		session->bus_queues = g_slist_append(session->bus_queues, q);
+		if (!q->thread)
+			return SIGROK_ERR;
+	}
+
+	return SIGROK_OK;
+}
+
+static void bus_queues_stop(struct session *session)
+{
+	GSList *l;
+
+	/* The analyzers still feed the callbacks, so they go first. */
+	if (session->pa_queue) {
+		bus_queue_destroy(session, session->pa_queue);
+		session->pa_queue = NULL;
+	}
+
+	for (l = session->bus_queues; l; l = l->next)
+		bus_queue_destroy(session, l->data);
+	g_slist_free(session->bus_queues);
+	session->bus_queues = NULL;
+}
+
+/* Drop the packets held back waiting for the trigger. */
+static void bus_trigger_drop(struct bus_trigger *bt)
+{
+	struct datafeed_packet *held;
+
+	while ((held = g_queue_pop_head(bt->held))) {
+		if (held->buffer)
+			packet_buffer_unref(held->buffer);
+		g_free(held);
+	}
+	bt->held_samples = 0;
+}
+
+static void bus_trigger_free(gpointer data)
+{
+	struct bus_trigger *bt;
+
+	bt = data;
+	if (bt->soft)
+		soft_trigger_destroy(bt->soft);
+	bus_trigger_drop(bt);
+	g_queue_free(bt->held);
+	g_free(bt);
+}
+
+static struct bus_trigger *bus_trigger_get(struct session *session,
+					   struct device *device)
+{
+	struct bus_trigger *bt;
+
+	if (!session->triggers)
+		session->triggers = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, bus_trigger_free);
+
+	if (!(bt = g_hash_table_lookup(session->triggers, device))) {
+		bt = g_malloc0(sizeof(struct bus_trigger));
+		bt->held = g_queue_new();
+		g_hash_table_insert(session->triggers, device, bt);
+	}
+
+	return bt;
+}
+
+/*
+ * Pick the triggers the session runs itself. This is done before any driver
+ * starts, so session_bus() can look them up without locking.
+ */
+static void bus_triggers_setup(struct session *session)
+{
+	struct device *device;
+	struct trigger *trigger;
+	struct bus_trigger *bt;
+	GSList *l, *t;
+
+	if (session->triggers)
+		g_hash_table_remove_all(session->triggers);
+
+	for (l = session->devices; l; l = l->next) {
+		device = l->data;
+		if (session->pretrigger)
+			bus_trigger_get(session, device);
+		for (t = device->triggers; t; t = t->next) {
+			trigger = t->data;
+			if (device_trigger_supported(device, trigger->type))
+				continue;
+			if (trigger->type == TRIGGER_TYPE_PROTO
+			    && !session->analyzers) {
+				g_warning("protocol trigger without analyzers");
+				continue;
+			}
+			if (trigger->type == TRIGGER_TYPE_DUMMY) {
+				g_warning("trigger type %d not supported",
+					  trigger->type);
+				continue;
+			}
+			bt = bus_trigger_get(session, device);
+			if (bt->trigger) {
+				g_warning("only one software trigger per "
+					  "device, ignoring the others");
+				break;
+			}
+			bt->trigger = trigger;
+		}
+	}
+}
+
+int session_start(struct session *session)
 {
 	struct device *device;
 	GSList *l;
 	int ret;
 
 	g_message("starting acquisition");
+	ret = SIGROK_OK;
+	bus_triggers_setup(session);
+	/* Drivers add their sources to this session's loop. */
+	session_loop_reset(session);
+	session_set_current(session);
 	for (l = session->devices; l; l = l->next) {
 		device = l->data;
+		if (!device->plugin)
+			continue;
 		if ((ret = device->plugin->start_acquisition(
 				device->plugin_index, device)) != SIGROK_OK)
 			break;
 	}
+	session_set_current(NULL);
 
 	return ret;
 }
 
-void session_stop(void)
+void session_stop(struct session *session)
 {
 	struct device *device;
 	GSList *l;
 
 	g_message("stopping acquisition");
+	session_set_current(session);
 	for (l = session->devices; l; l = l->next) {
 		device = l->data;
-		device->plugin->stop_acquisition(device->plugin_index, device);
+		if (device->plugin)
+			device->plugin->stop_acquisition(
+					device->plugin_index, device);
 	}
+	session_set_current(NULL);
+	/* Whatever sources the drivers left behind. */
+	session_source_clear(session);
+	bus_queues_stop(session);
 }
 
-void session_bus(struct device *device, struct datafeed_packet *packet)
+/*
+ * Make a copy of a packet that can be queued. The driver's payload is only
+ * valid until session_bus() returns, so unless it is in a pooled buffer
+ * already, it is copied into one. The caller drops the reference taken
+ * on the buffer.
+ */
+static int bus_packet_hold(struct datafeed_packet *packet,
+			   struct datafeed_packet *held)
+{
+	*held = *packet;
+	if (packet->type == DF_END || packet->type == DF_TRIGGER) {
+		/* No payload, whatever the driver left in there. */
+		held->length = 0;
+		held->payload = NULL;
+		held->buffer = NULL;
+	} else if ((packet->type != DF_LOGIC && packet->type != DF_ANALOG
+		    && packet->type != DF_PD) || !packet->buffer) {
+		if (!(held->buffer = packet_buffer_new(packet->length))) {
+			g_warning("out of memory queueing packet");
+			return SIGROK_ERR_MALLOC;
+		}
+		memcpy(held->buffer->data, packet->payload, packet->length);
+		held->payload = held->buffer->data;
+	} else {
+		packet_buffer_ref(held->buffer);
+	}
+
+	return SIGROK_OK;
+}
+
+/* Hand a packet to the threaded bus queues, all sharing one copy. */
+static void session_bus_queue(struct session *session, struct device *device,
+			      struct datafeed_packet *packet)
+{
+	struct datafeed_packet qpacket;
+	GSList *l;
+
+	if (bus_packet_hold(packet, &qpacket) != SIGROK_OK)
+		return;
+
+	g_mutex_lock(session->bus_mutex);
+	if (!session->bus_queues && bus_queues_start(session) != SIGROK_OK)
+		g_warning("failed to start datafeed threads");
+	for (l = session->bus_queues; l; l = l->next)
+		bus_queue_push(l->data, device, &qpacket);
+	g_mutex_unlock(session->bus_mutex);
+
+	if (qpacket.buffer)
+		packet_buffer_unref(qpacket.buffer);
+}
+
+static void session_bus_dispatch(struct session *session,
+				 struct device *device,
+				 struct datafeed_packet *packet);
+
+/*
+ * Hold back samples until the trigger, keeping the last session->pretrigger
+ * of them. Whole packets are held, only the first one may need trimming
+ * when they're sent on. Returns TRUE if the packet was taken care of.
+ */
+static int bus_trigger_gate(struct session *session, struct device *device,
+			    struct bus_trigger *bt,
+			    struct datafeed_packet *packet)
+{
+	struct datafeed_packet *held;
+	uint64_t skip, n;
+
+	switch (packet->type) {
+	case DF_HEADER:
+		bus_trigger_drop(bt);
+		bt->waiting = session->pretrigger != 0;
+		return FALSE;
+	case DF_END:
+		/* The trigger never came. */
+		bus_trigger_drop(bt);
+		bt->waiting = FALSE;
+		return FALSE;
+	case DF_LOGIC:
+	case DF_ANALOG:
+		if (!bt->waiting || !packet->unitsize)
+			return FALSE;
+		held = g_malloc(sizeof(struct datafeed_packet));
+		if (bus_packet_hold(packet, held) != SIGROK_OK) {
+			g_free(held);
+			return TRUE;
+		}
+		g_queue_push_tail(bt->held, held);
+		bt->held_samples += held->length / held->unitsize;
+		while ((held = g_queue_peek_head(bt->held))) {
+			n = held->length / held->unitsize;
+			if (bt->held_samples - n < session->pretrigger)
+				break;
+			g_queue_pop_head(bt->held);
+			bt->held_samples -= n;
+			if (held->buffer)
+				packet_buffer_unref(held->buffer);
+			g_free(held);
+		}
+		return TRUE;
+	case DF_TRIGGER:
+		if (!bt->waiting)
+			return FALSE;
+		bt->waiting = FALSE;
+		skip = 0;
+		if (bt->held_samples > session->pretrigger)
+			skip = bt->held_samples - session->pretrigger;
+		while ((held = g_queue_pop_head(bt->held))) {
+			held->payload = (uint8_t *)held->payload
+					+ skip * held->unitsize;
+			held->length -= skip * held->unitsize;
+			skip = 0;
+			session_bus_dispatch(session, device, held);
+			if (held->buffer)
+				packet_buffer_unref(held->buffer);
+			g_free(held);
+		}
+		bt->held_samples = 0;
+		return FALSE;
+	}
+
+	return FALSE;
+}
+
+/* Send a packet on to the datafeed callbacks. */
+static void session_bus_dispatch(struct session *session,
+				 struct device *device,
+				 struct datafeed_packet *packet)
 {
+	struct bus_trigger *bt;
 	GSList *l;
 	datafeed_callback cb;
 
-	/*
-	 * TODO: Send packet through PA pipe, and send the output of that to
-	 * the callbacks as well.
-	 */
+	if (session->triggers
+	    && (bt = g_hash_table_lookup(session->triggers, device))
+	    && bus_trigger_gate(session, device, bt, packet))
+		return;
+
+	if (session->bus_queue_len) {
+		session_bus_queue(session, device, packet);
+		return;
+	}
+
 	for (l = session->datafeed_callbacks; l; l = l->next) {
 		cb = l->data;
 		cb(device, packet);
 	}
 }
 
-void make_metadata(char *filename)
+/* Number of samples a device has sent since its header, for DF_PD. */
+static uint64_t *pa_position(struct session *session,
+			     struct device *device)
+{
+	uint64_t *pos;
+
+	if (!session->pa_positions)
+		session->pa_positions = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, g_free);
+
+	if (!(pos = g_hash_table_lookup(session->pa_positions, device))) {
+		pos = g_malloc0(sizeof(uint64_t));
+		g_hash_table_insert(session->pa_positions, device, pos);
+	}
+
+	return pos;
+}
+
+/* Whether an analyzer's output matches a protocol trigger. */
+static int proto_match(struct trigger_proto *proto, struct analyzer *an,
+		       uint8_t *out, uint64_t out_len)
+{
+	char *text;
+	int ret;
+
+	if (!an->name || strcmp(an->name, proto->analyzer))
+		return FALSE;
+
+	text = g_strndup((char *)out, out_len);
+	ret = g_pattern_match_simple(proto->pattern, text);
+	g_free(text);
+
+	return ret;
+}
+
+/*
+ * Runs in the analyzer thread: pass the packet through every analyzer and
+ * send their output on as DF_PD packets, right after the packet they came
+ * from. DF_END stays the last packet though. If the output matches the
+ * device's protocol trigger, a DF_TRIGGER goes before the packet.
+ */
+static void pa_run(struct device *device, struct datafeed_packet *packet)
+{
+	struct session *session;
+	struct analyzer *an;
+	struct bus_trigger *bt;
+	struct datafeed_pd *pd;
+	struct datafeed_packet pd_packet;
+	struct packet_buffer *pbuf;
+	GSList *l, *outputs;
+	uint64_t *pos, num_samples, out_len;
+	uint8_t *out;
+	int fired;
+
+	session = device->session;
+	bt = NULL;
+	if (session->triggers)
+		bt = g_hash_table_lookup(session->triggers, device);
+	if (bt && (!bt->trigger || bt->trigger->type != TRIGGER_TYPE_PROTO))
+		bt = NULL;
+
+	pos = pa_position(session, device);
+	if (packet->type == DF_HEADER) {
+		*pos = 0;
+		if (bt)
+			bt->done = FALSE;
+	}
+	num_samples = 0;
+	if (packet->type == DF_LOGIC && packet->unitsize)
+		num_samples = packet->length / packet->unitsize;
+
+	outputs = NULL;
+	fired = FALSE;
+	for (l = session->analyzers; l; l = l->next) {
+		an = l->data;
+		out_len = 0;
+		if (!an->decode)
+			continue;
+		if (an->decode(an, device, packet, &out, &out_len) != SIGROK_OK
+		    || !out_len)
+			continue;
+
+		if (bt && !bt->done
+		    && proto_match(bt->trigger->proto, an, out, out_len))
+			fired = bt->done = TRUE;
+
+		if (!(pbuf = packet_buffer_new(sizeof(struct datafeed_pd)
+					       + out_len))) {
+			g_warning("out of memory for %s output", an->name);
+			continue;
+		}
+		pd = pbuf->data;
+		pd->analyzer = an;
+		pd->start_sample = *pos;
+		pd->num_samples = num_samples;
+		pd->length = out_len;
+		memcpy(pd->data, out, out_len);
+		outputs = g_slist_append(outputs, pbuf);
+	}
+	*pos += num_samples;
+
+	if (fired) {
+		pd_packet.type = DF_TRIGGER;
+		pd_packet.length = 0;
+		pd_packet.unitsize = 0;
+		pd_packet.payload = NULL;
+		pd_packet.buffer = NULL;
+		session_bus_dispatch(session, device, &pd_packet);
+	}
+
+	if (packet->type != DF_END)
+		session_bus_dispatch(session, device, packet);
+
+	for (l = outputs; l; l = l->next) {
+		pbuf = l->data;
+		pd = pbuf->data;
+		pd_packet.type = DF_PD;
+		pd_packet.length = sizeof(struct datafeed_pd) + pd->length;
+		pd_packet.unitsize = 0;
+		pd_packet.payload = pd;
+		pd_packet.buffer = pbuf;
+		session_bus_dispatch(session, device, &pd_packet);
+		packet_buffer_unref(pbuf);
+	}
+	g_slist_free(outputs);
+
+	if (packet->type == DF_END)
+		session_bus_dispatch(session, device, packet);
+}
+
+/* Queue a packet for the analyzer thread, starting it if needed. */
+static void session_bus_pa(struct session *session, struct device *device,
+			   struct datafeed_packet *packet)
+{
+	struct datafeed_packet qpacket;
+
+	if (bus_packet_hold(packet, &qpacket) != SIGROK_OK)
+		return;
+
+	g_mutex_lock(session->pa_mutex);
+	if (!session->pa_queue) {
+		/* Analyzers need every packet, so this one never drops. */
+		session->pa_queue = bus_queue_new(pa_run, session->bus_queue_len
+						  ? session->bus_queue_len
+						  : PA_QUEUE_LEN,
+						  BUS_QUEUE_BLOCK);
+		if (!session->pa_queue->thread)
+			g_warning("failed to start analyzer thread");
+	}
+	bus_queue_push(session->pa_queue, device, &qpacket);
+	g_mutex_unlock(session->pa_mutex);
+
+	if (qpacket.buffer)
+		packet_buffer_unref(qpacket.buffer);
+}
+
+static void session_bus_send(struct session *session, struct device *device,
+			     struct datafeed_packet *packet)
+{
+	/* Analyzer output is only ever sent from the analyzer thread. */
+	if (session->analyzers && packet->type != DF_PD) {
+		session_bus_pa(session, device, packet);
+		return;
+	}
+
+	session_bus_dispatch(session, device, packet);
+}
+
+/*
+ * Run a software trigger over the device's samples. Once it fires, the
+ * packet is sent in two parts with a DF_TRIGGER in between, right before
+ * the sample the trigger matched on; a logic trigger whose stages started
+ * in an earlier packet gets it at the start of this one. Returns TRUE if
+ * the packet was sent here.
+ */
+static int session_bus_trigger(struct session *session,
+			       struct device *device, struct bus_trigger *bt,
+			       struct datafeed_packet *packet)
+{
+	struct datafeed_header *header;
+	struct datafeed_packet part, trigger_packet;
+	int64_t ret;
+	uint64_t at;
+
+	/* Protocol triggers are up to the analyzer thread. */
+	if (!bt->trigger || bt->trigger->type == TRIGGER_TYPE_PROTO)
+		return FALSE;
+
+	if (packet->type == DF_HEADER) {
+		header = packet->payload;
+		bt->samplerate = header->samplerate;
+		if (bt->soft) {
+			soft_trigger_destroy(bt->soft);
+			bt->soft = NULL;
+		}
+		bt->done = FALSE;
+		return FALSE;
+	}
+
+	if (packet->type != DF_LOGIC || bt->done || !packet->unitsize)
+		return FALSE;
+
+	if (!bt->soft && (ret = soft_trigger_new(bt->trigger,
+			packet->unitsize, bt->samplerate, &bt->soft))) {
+		g_warning("failed to set up software trigger: %d", (int)ret);
+		bt->done = TRUE;
+		return FALSE;
+	}
+
+	if ((ret = soft_trigger_run(bt->soft, packet->payload,
+				    packet->length)) < 0)
+		return FALSE;
+	bt->done = TRUE;
+
+	at = MAX(ret - bt->soft->num_stages, 0) * packet->unitsize;
+	part = *packet;
+	if (at) {
+		part.length = at;
+		session_bus_send(session, device, &part);
+	}
+
+	trigger_packet.type = DF_TRIGGER;
+	trigger_packet.length = 0;
+	trigger_packet.unitsize = 0;
+	trigger_packet.payload = NULL;
+	trigger_packet.buffer = NULL;
+	session_bus_send(session, device, &trigger_packet);
+
+	if (at < packet->length) {
+		part.payload = (uint8_t *)packet->payload + at;
+		part.length = packet->length - at;
+		session_bus_send(session, device, &part);
+	}
+
+	return TRUE;
+}
+
+void session_bus(struct device *device, struct datafeed_packet *packet)
+{
+	struct session *session;
+	struct bus_trigger *bt;
+
+	if (!(session = device->session)) {
+		g_warning("packet from a device that is not in a session");
+		return;
+	}
+
+	if (session->triggers && packet->type != DF_PD
+	    && (bt = g_hash_table_lookup(session->triggers, device))
+	    && session_bus_trigger(session, device, bt, packet))
+		return;
+
+	session_bus_send(session, device, packet);
+}
+
+void make_metadata(struct session *session, char *filename)
 {
 	GSList *l, *p;
 	struct device *device;
 	struct probe *probe;
 	FILE *f;
+	uint64_t *samplerate;
 	int devcnt;
 
 	f = fopen(filename, "wb");
@@ -161,10 +1095,24 @@ void make_metadata(char *filename)
 	for (l = session->devices; l; l = l->next) {
 		device = l->data;
 		fprintf(f, "[device]\n");
-		fprintf(f, "driver = %s\n", device->plugin->name);
+		if (device->plugin) {
+			fprintf(f, "driver = %s\n", device->plugin->name);
+			samplerate = device->plugin->get_device_info(
+				device->plugin_index, DI_CUR_SAMPLERATE);
+			if (samplerate)
+				fprintf(f, "samplerate = %" PRIu64 "\n",
+					*samplerate);
+		} else {
+			/* E.g. an input file's device. */
+			fprintf(f, "driver = none\n");
+		}
 
-		if (device->datastore)
+		if (device->datastore) {
 			fprintf(f, "capturefile = raw-%d\n", devcnt);
+			fprintf(f, "blockindex = index-%d\n", devcnt);
+			fprintf(f, "unitsize = %d\n",
+				device->datastore->ds_unitsize);
+		}
 
 		for (p = device->probes; p; p = p->next) {
 			probe = p->data;
@@ -184,15 +1132,159 @@ void make_metadata(char *filename)
 	fclose(f);
 }
 
-int session_save(char *filename)
+/*
+ * libzip source callback which hands the datastore's chunks to libzip as it
+ * compresses them, instead of first copying the whole capture into one big
+ * buffer. Memory use while saving is thus independent of the capture size.
+ */
+static ssize_t datastore_zip_read(void *state, void *data, size_t len,
+				  enum zip_source_cmd cmd)
 {
-	GSList *l, *d;
+	struct datastore_zip_source *dzs;
+	struct zip_stat *st;
+	uint64_t size, avail, unit, unit_offset, value;
+	size_t done;
+	char *src;
+
+	dzs = state;
+	size = dzs->count * dzs->ds->ds_unitsize;
+
+	switch (cmd) {
+	case ZIP_SOURCE_OPEN:
+		dzs->pos = 0;
+		return 0;
+	case ZIP_SOURCE_READ:
+		done = 0;
+		while (done < len && dzs->pos < size) {
+			unit = dzs->start + dzs->pos / dzs->ds->ds_unitsize;
+			unit_offset = dzs->pos % dzs->ds->ds_unitsize;
+			if ((dzs->ds->flags & DATASTORE_RLE) && !unit_offset
+			    && len - done >= (size_t)dzs->ds->ds_unitsize) {
+				/* No chunks, expand runs straight into data. */
+				avail = MIN(len - done, size - dzs->pos)
+					/ dzs->ds->ds_unitsize;
+				if (datastore_get(dzs->ds, unit, avail,
+						  (char *)data + done)
+				    != SIGROK_OK)
+					return -1;
+				done += avail * dzs->ds->ds_unitsize;
+				dzs->pos += avail * dzs->ds->ds_unitsize;
+				continue;
+			} else if (dzs->ds->flags & DATASTORE_RLE) {
+				/* Only part of a unit is copied. */
+				if (datastore_get(dzs->ds, unit, 1, &value)
+				    != SIGROK_OK)
+					return -1;
+				src = (char *)&value;
+				avail = 1;
+			} else if (!(src = datastore_get_ptr(dzs->ds, unit,
+							     &avail))) {
+				return -1;
+			}
+			avail = avail * dzs->ds->ds_unitsize - unit_offset;
+			if (avail > size - dzs->pos)
+				avail = size - dzs->pos;
+			if (avail > len - done)
+				avail = len - done;
+			memcpy((char *)data + done, src + unit_offset, avail);
+			done += avail;
+			dzs->pos += avail;
+		}
+		return done;
+	case ZIP_SOURCE_CLOSE:
+		return 0;
+	case ZIP_SOURCE_STAT:
+		if (len < sizeof(struct zip_stat))
+			return -1;
+		st = data;
+		zip_stat_init(st);
+		st->size = size;
+		st->mtime = time(NULL);
+#ifdef ZIP_STAT_SIZE
+		st->valid |= ZIP_STAT_SIZE | ZIP_STAT_MTIME;
+#endif
+		return sizeof(struct zip_stat);
+	case ZIP_SOURCE_ERROR:
+		if (len < sizeof(int) * 2)
+			return -1;
+		/* Reading from memory never fails. */
+		((int *)data)[0] = ((int *)data)[1] = 0;
+		return sizeof(int) * 2;
+	case ZIP_SOURCE_FREE:
+		g_free(dzs);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static struct zip_source *datastore_zip_source(struct zip *zipfile,
+		struct datastore *ds, uint64_t start, uint64_t count)
+{
+	struct datastore_zip_source *dzs;
+	struct zip_source *src;
+
+	if (!(dzs = g_try_malloc(sizeof(struct datastore_zip_source))))
+		return NULL;
+	dzs->ds = ds;
+	dzs->start = start;
+	dzs->count = count;
+	dzs->pos = 0;
+
+	if (!(src = zip_source_function(zipfile, datastore_zip_read, dzs)))
+		g_free(dzs);
+
+	return src;
+}
+
+/*
+ * Add the datastore's units to the archive as raw-<devcnt>-<block> members of
+ * SESSION_BLOCK_UNITS units each, and describe them in the block index: one
+ * line per block, holding its first unit, its number of units and the
+ * member name. Readers use this to only inflate the blocks they need.
+ */
+static int save_blocks(struct zip *zipfile, struct datastore *ds, int devcnt,
+		       GString *index)
+{
+	struct zip_source *src;
+	uint64_t start, count;
+	unsigned int block;
+	char rawname[32];
+
+	block = 0;
+	for (start = 0; start < ds->num_units; start += count) {
+		count = ds->num_units - start;
+		if (count > SESSION_BLOCK_UNITS)
+			count = SESSION_BLOCK_UNITS;
+
+		/*
+		 * The datastore is read when zip_close() writes the archive,
+		 * so it must stay around until then.
+		 */
+		if (!(src = datastore_zip_source(zipfile, ds, start, count)))
+			return SIGROK_ERR;
+		snprintf(rawname, sizeof(rawname), "raw-%d-%u", devcnt,
+			 block++);
+		if (zip_add(zipfile, rawname, src) == -1) {
+			zip_source_free(src);
+			return SIGROK_ERR;
+		}
+		g_string_append_printf(index, "%" PRIu64 " %" PRIu64 " %s\n",
+				       start, count, rawname);
+	}
+
+	return SIGROK_OK;
+}
+
+int session_save(struct session *session, char *filename)
+{
+	GSList *l, *indexes;
+	GString *index;
 	struct device *device;
-	struct datastore *ds;
 	struct zip *zipfile;
 	struct zip_source *src;
-	int bufcnt, devcnt, tmpfile, ret, error;
-	char version[1], rawname[16], metafile[32], *buf;
+	int devcnt, tmpfile, ret, error;
+	char version[1], indexname[16], metafile[32];
 
 	/* Quietly delete it first, libzip wants replace ops otherwise. */
 	unlink(filename);
@@ -201,7 +1293,7 @@ int session_save(char *filename)
 		return SIGROK_ERR;
 
 	/* Version */
-	version[0] = '1';
+	version[0] = '2';
 	if (!(src = zip_source_buffer(zipfile, version, 1, 0)))
 		return SIGROK_ERR;
 	if (zip_add(zipfile, "version", src) == -1) {
@@ -215,41 +1307,49 @@ int session_save(char *filename)
 	if ((tmpfile = g_mkstemp(metafile)) == -1)
 		return SIGROK_ERR;
 	close(tmpfile);
-	make_metadata(metafile);
+	make_metadata(session, metafile);
 	if (!(src = zip_source_file(zipfile, metafile, 0, -1)))
 		return SIGROK_ERR;
 	if (zip_add(zipfile, "metadata", src) == -1)
 		return SIGROK_ERR;
 	unlink(metafile);
 
-	/* Raw */
+	/* Raw blocks and their index, per device */
+	ret = SIGROK_OK;
+	indexes = NULL;
 	devcnt = 1;
-	for (l = session->devices; l; l = l->next) {
+	for (l = session->devices; l && ret == SIGROK_OK; l = l->next) {
 		device = l->data;
-		ds = device->datastore;
-		if (ds) {
-			buf = malloc(ds->num_units * ds->ds_unitsize +
-				   DATASTORE_CHUNKSIZE);
-			bufcnt = 0;
-			for (d = ds->chunklist; d; d = d->next) {
-				memcpy(buf + bufcnt, d->data,
-				       DATASTORE_CHUNKSIZE);
-				bufcnt += DATASTORE_CHUNKSIZE;
+		if (device->datastore) {
+			/* libzip only reads the index in zip_close(). */
+			index = g_string_new("");
+			indexes = g_slist_append(indexes, index);
+			ret = save_blocks(zipfile, device->datastore, devcnt,
+					  index);
+			if (ret != SIGROK_OK)
+				break;
+			if (!(src = zip_source_buffer(zipfile, index->str,
+						      index->len, 0))) {
+				ret = SIGROK_ERR;
+				break;
+			}
+			snprintf(indexname, 15, "index-%d", devcnt);
+			if (zip_add(zipfile, indexname, src) == -1) {
+				zip_source_free(src);
+				ret = SIGROK_ERR;
 			}
-			if (!(src = zip_source_buffer(zipfile, buf,
-				       ds->num_units * ds->ds_unitsize, TRUE)))
-				return SIGROK_ERR;
-			snprintf(rawname, 15, "raw-%d", devcnt);
-			if (zip_add(zipfile, rawname, src) == -1)
-				return SIGROK_ERR;
 		}
 		devcnt++;
 	}
 
-	if ((ret = zip_close(zipfile)) == -1) {
+	if (ret == SIGROK_OK && zip_close(zipfile) == -1) {
 		g_message("error saving zipfile: %s", zip_strerror(zipfile));
-		return SIGROK_ERR;
+		ret = SIGROK_ERR;
 	}
 
-	return SIGROK_OK;
+	for (l = indexes; l; l = l->next)
+		g_string_free(l->data, TRUE);
+	g_slist_free(indexes);
+
+	return ret;
 }
@@ -0,0 +1,791 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2011 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <zip.h>
+#include <glib.h>
+#include <sigrok.h>
+
+/* Number of units read from a capture file and sent out per packet. */
+#define SESSION_READ_UNITS	65536
+
+/* Skipped data inside a block is read in pieces of this many bytes. */
+#define SESSION_SKIP_BYTES	65536
+
+/*
+ * One separately compressed member of the archive holding a range of a
+ * device's samples. Version 1 files have a single block per device.
+ */
+struct session_block {
+	uint64_t start;
+	uint64_t units;
+	char *member;
+};
+
+/*
+ * A device recorded in a session file. The samples are only read from the
+ * archive, one packet at a time, once the acquisition is started.
+ */
+struct session_vdevice {
+	char *sessionfile;
+	char *capturefile;
+	char *blockindex;
+	/* Sorted by start unit, and contiguous */
+	struct session_block *blocks;
+	int num_blocks;
+	/* Block capfile is reading from */
+	int cur_block;
+	struct zip *archive;
+	struct zip_file *capfile;
+	uint64_t samplerate;
+	int unitsize;
+	int num_probes;
+	gpointer session_device_id;
+	/* Sent its header, but not DF_END yet */
+	gboolean running;
+	/* The loaded file this device came from */
+	struct session_file *file;
+	/* The device add_vdevice() created for it */
+	struct device *device;
+};
+
+/*
+ * The devices session_load() created for a session, which owns them. They
+ * are all fed from one source while the session runs.
+ */
+struct session_file {
+	/* List of struct sigrok_device_instance */
+	GSList *device_instances;
+	/* Whether the receive_data() source is currently registered */
+	gboolean source_active;
+};
+
+static int capabilities[] = {
+	HWCAP_LOGIC_ANALYZER,
+	0,
+};
+
+/*
+ * The instances of all loaded sessions. The plugin API only passes a device
+ * index around, so this is just for looking them up by it.
+ */
+static GSList *all_instances = NULL;
+static int next_index = 0;
+static GStaticMutex instances_mutex = G_STATIC_MUTEX_INIT;
+
+static struct sigrok_device_instance *find_instance(int device_index)
+{
+	struct sigrok_device_instance *sdi;
+
+	g_static_mutex_lock(&instances_mutex);
+	sdi = get_sigrok_device_instance(all_instances, device_index);
+	g_static_mutex_unlock(&instances_mutex);
+
+	return sdi;
+}
+
+static void vdevice_close(struct session_vdevice *vdev)
+{
+	if (vdev->capfile) {
+		zip_fclose(vdev->capfile);
+		vdev->capfile = NULL;
+	}
+	if (vdev->archive) {
+		zip_close(vdev->archive);
+		vdev->archive = NULL;
+	}
+}
+
+static void vdevice_free(struct session_vdevice *vdev)
+{
+	int i;
+
+	vdevice_close(vdev);
+	for (i = 0; i < vdev->num_blocks; i++)
+		g_free(vdev->blocks[i].member);
+	g_free(vdev->blocks);
+	g_free(vdev->sessionfile);
+	g_free(vdev->capturefile);
+	g_free(vdev->blockindex);
+	g_free(vdev);
+}
+
+/* Returns the index of the block holding the given unit, or -1. */
+static int find_block(struct session_vdevice *vdev, uint64_t unit)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = vdev->num_blocks - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (unit < vdev->blocks[mid].start)
+			hi = mid - 1;
+		else if (unit >= vdev->blocks[mid].start
+				+ vdev->blocks[mid].units)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+
+	return -1;
+}
+
+/*
+ * Open a block member for reading, and skip the given number of units into
+ * it. Zip members can't seek, so only the data before that point in this
+ * one block gets inflated and thrown away.
+ */
+static struct zip_file *open_block(struct zip *archive,
+		struct session_vdevice *vdev, int block, uint64_t skip)
+{
+	struct zip_file *zf;
+	uint64_t bytes;
+	ssize_t ret;
+	char *buf;
+
+	if (!(zf = zip_fopen(archive, vdev->blocks[block].member, 0))) {
+		g_warning("session file: no capture file %s in %s",
+			  vdev->blocks[block].member, vdev->sessionfile);
+		return NULL;
+	}
+
+	if (!skip)
+		return zf;
+
+	buf = g_malloc(SESSION_SKIP_BYTES);
+	bytes = skip * vdev->unitsize;
+	while (bytes > 0) {
+		ret = zip_fread(zf, buf, MIN(bytes, SESSION_SKIP_BYTES));
+		if (ret <= 0) {
+			zip_fclose(zf);
+			zf = NULL;
+			break;
+		}
+		bytes -= ret;
+	}
+	g_free(buf);
+
+	return zf;
+}
+
+/* Send DF_END, unless the device already did. */
+static void vdevice_end(struct session_vdevice *vdev)
+{
+	struct datafeed_packet packet;
+
+	if (!vdev->running)
+		return;
+	vdev->running = FALSE;
+
+	packet.type = DF_END;
+	packet.length = 0;
+	packet.unitsize = 0;
+	packet.payload = NULL;
+	packet.buffer = NULL;
+	session_bus(vdev->session_device_id, &packet);
+}
+
+/*
+ * Feed one packet's worth of samples from every device that still has
+ * data into the session bus. This keeps memory use constant no matter how
+ * big the capture files are, and output starts right away.
+ */
+static int receive_data(int fd, int revents, void *user_data)
+{
+	struct session_file *file;
+	struct sigrok_device_instance *sdi;
+	struct session_vdevice *vdev;
+	struct datafeed_packet packet;
+	struct packet_buffer *buf;
+	GSList *l;
+	ssize_t ret;
+	gboolean got_data;
+
+	/* Avoid compiler warnings. */
+	fd = fd;
+	revents = revents;
+
+	file = user_data;
+	got_data = FALSE;
+	for (l = file->device_instances; l; l = l->next) {
+		sdi = l->data;
+		vdev = sdi->priv;
+		if (!vdev->capfile)
+			/* Already done with this device. */
+			continue;
+		got_data = TRUE;
+
+		buf = packet_buffer_new(SESSION_READ_UNITS * vdev->unitsize);
+		if (!buf)
+			ret = -1;
+		else
+			ret = zip_fread(vdev->capfile, buf->data,
+					SESSION_READ_UNITS * vdev->unitsize);
+		if (ret == 0 && vdev->cur_block + 1 < vdev->num_blocks) {
+			/* On to the next block. */
+			packet_buffer_unref(buf);
+			zip_fclose(vdev->capfile);
+			vdev->capfile = open_block(vdev->archive, vdev,
+						   ++vdev->cur_block, 0);
+			if (vdev->capfile)
+				continue;
+			buf = NULL;
+			ret = -1;
+		}
+		if (ret > 0) {
+			packet.type = DF_LOGIC;
+			packet.length = ret;
+			packet.unitsize = vdev->unitsize;
+			packet.payload = buf->data;
+			packet.buffer = buf;
+			session_bus(vdev->session_device_id, &packet);
+		} else {
+			/* End of file, or a read error. */
+			if (ret == -1)
+				g_warning("session file: error reading %s",
+					  vdev->capturefile);
+			vdevice_close(vdev);
+			vdevice_end(vdev);
+		}
+		if (buf)
+			packet_buffer_unref(buf);
+	}
+
+	if (!got_data) {
+		source_remove_callback(-1, receive_data, file);
+		file->source_active = FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * API callbacks
+ */
+
+static int hw_init(char *deviceinfo)
+{
+	/* Avoid compiler warnings. */
+	deviceinfo = deviceinfo;
+
+	/* Devices are only created by session_load(). */
+	return 0;
+}
+
+static void hw_cleanup(void)
+{
+	/* The devices are freed along with their session. */
+}
+
+static int hw_opendev(int device_index)
+{
+	if (!find_instance(device_index))
+		return SIGROK_ERR;
+
+	return SIGROK_OK;
+}
+
+static void hw_closedev(int device_index)
+{
+	struct sigrok_device_instance *sdi;
+
+	if ((sdi = find_instance(device_index)))
+		vdevice_close(sdi->priv);
+}
+
+static void *hw_get_device_info(int device_index, int device_info_id)
+{
+	struct sigrok_device_instance *sdi;
+	struct session_vdevice *vdev;
+	void *info = NULL;
+
+	if (!(sdi = find_instance(device_index)))
+		return NULL;
+	vdev = sdi->priv;
+
+	switch (device_info_id) {
+	case DI_INSTANCE:
+		info = sdi;
+		break;
+	case DI_NUM_PROBES:
+		info = GINT_TO_POINTER(vdev->num_probes);
+		break;
+	case DI_CUR_SAMPLERATE:
+		info = &vdev->samplerate;
+		break;
+	}
+
+	return info;
+}
+
+static int hw_get_status(int device_index)
+{
+	if (!find_instance(device_index))
+		return ST_NOT_FOUND;
+
+	return ST_ACTIVE;
+}
+
+static int *hw_get_capabilities(void)
+{
+	return capabilities;
+}
+
+static int hw_set_configuration(int device_index, int capability, void *value)
+{
+	/* Avoid compiler warnings. */
+	device_index = device_index;
+	value = value;
+
+	/* The recorded probes are always sent as they are. */
+	if (capability == HWCAP_PROBECONFIG)
+		return SIGROK_OK;
+
+	return SIGROK_ERR;
+}
+
+static int hw_start_acquisition(int device_index, gpointer session_device_id)
+{
+	struct sigrok_device_instance *sdi;
+	struct session_vdevice *vdev;
+	struct datafeed_header header;
+	struct datafeed_packet packet;
+	int err;
+
+	if (!(sdi = find_instance(device_index)))
+		return SIGROK_ERR;
+	vdev = sdi->priv;
+
+	if (!(vdev->archive = zip_open(vdev->sessionfile, 0, &err))) {
+		g_warning("session file: failed to open %s (zip error %d)",
+			  vdev->sessionfile, err);
+		return SIGROK_ERR;
+	}
+
+	vdev->cur_block = 0;
+	if (!(vdev->capfile = open_block(vdev->archive, vdev, 0, 0))) {
+		vdevice_close(vdev);
+		return SIGROK_ERR;
+	}
+
+	vdev->session_device_id = session_device_id;
+
+	/* Send header packet to the session bus. */
+	packet.type = DF_HEADER;
+	packet.length = sizeof(struct datafeed_header);
+	packet.payload = &header;
+	header.feed_version = 1;
+	gettimeofday(&header.starttime, NULL);
+	header.samplerate = vdev->samplerate;
+	header.protocol_id = PROTO_RAW;
+	header.num_logic_probes = vdev->num_probes;
+	header.num_analog_probes = 0;
+	session_bus(session_device_id, &packet);
+	vdev->running = TRUE;
+
+	/* All devices in the session file are fed from the same source. */
+	if (!vdev->file->source_active) {
+		source_add(-1, 0, 0, receive_data, vdev->file);
+		vdev->file->source_active = TRUE;
+	}
+
+	return SIGROK_OK;
+}
+
+static void hw_stop_acquisition(int device_index, gpointer session_device_id)
+{
+	struct sigrok_device_instance *sdi;
+
+	/* Avoid compiler warnings. */
+	session_device_id = session_device_id;
+
+	if (!(sdi = find_instance(device_index)))
+		return;
+	vdevice_close(sdi->priv);
+	/* Unless the whole file was read already. */
+	vdevice_end(sdi->priv);
+}
+
+struct device_plugin session_driver = {
+	"session",
+	1,
+	hw_init,
+	hw_cleanup,
+	hw_opendev,
+	hw_closedev,
+	hw_get_device_info,
+	hw_get_status,
+	hw_get_capabilities,
+	hw_set_configuration,
+	hw_start_acquisition,
+	hw_stop_acquisition,
+};
+
+/* Read a whole (small) file from the archive into a NUL-terminated buffer. */
+static char *read_member(struct zip *archive, const char *name)
+{
+	struct zip_stat zs;
+	struct zip_file *zf;
+	char *buf;
+
+	if (zip_stat(archive, name, 0, &zs) == -1)
+		return NULL;
+
+	if (!(zf = zip_fopen(archive, name, 0)))
+		return NULL;
+
+	buf = g_malloc(zs.size + 1);
+	if (zip_fread(zf, buf, zs.size) != (ssize_t)zs.size) {
+		g_free(buf);
+		buf = NULL;
+	} else {
+		buf[zs.size] = 0;
+	}
+	zip_fclose(zf);
+
+	return buf;
+}
+
+/*
+ * Fill in the device's list of blocks. Version 2 files have a block index
+ * member with one "<start> <units> <member>" line per block; in version 1
+ * files the whole capture file is one block.
+ */
+static int load_blocks(struct zip *archive, int version,
+		       struct session_vdevice *vdev)
+{
+	struct session_block *block;
+	struct zip_stat zs;
+	uint64_t next;
+	char **lines, *index, member[64];
+	int ret, i;
+
+	if (version == 1) {
+		if (zip_stat(archive, vdev->capturefile, 0, &zs) == -1)
+			return SIGROK_ERR;
+		vdev->blocks = g_malloc(sizeof(struct session_block));
+		vdev->blocks[0].start = 0;
+		vdev->blocks[0].units = zs.size / vdev->unitsize;
+		vdev->blocks[0].member = g_strdup(vdev->capturefile);
+		vdev->num_blocks = 1;
+		return SIGROK_OK;
+	}
+
+	if (!vdev->blockindex || !(index = read_member(archive,
+						       vdev->blockindex)))
+		return SIGROK_ERR;
+	lines = g_strsplit(index, "\n", 0);
+	g_free(index);
+	vdev->blocks = g_malloc(sizeof(struct session_block)
+				* g_strv_length(lines));
+	next = 0;
+	for (i = 0; lines[i]; i++) {
+		if (!lines[i][0])
+			continue;
+		block = &vdev->blocks[vdev->num_blocks];
+		if (sscanf(lines[i], "%" SCNu64 " %" SCNu64 " %63s",
+			   &block->start, &block->units, member) != 3
+		    || block->start != next)
+			break;
+		block->member = g_strdup(member);
+		next += block->units;
+		vdev->num_blocks++;
+	}
+	/* Malformed, or the blocks don't follow each other. */
+	ret = lines[i] ? SIGROK_ERR : SIGROK_OK;
+	g_strfreev(lines);
+
+	return ret;
+}
+
+/*
+ * Turn one [device] section of the metadata into a device in the session.
+ * The capture file only holds the probes that were enabled, packed in
+ * order, so the new device gets exactly those probes.
+ */
+static int add_vdevice(struct session *session, const char *filename,
+		       struct zip *archive, int version,
+		       struct session_vdevice *vdev, GSList *probenames)
+{
+	struct sigrok_device_instance *sdi;
+	struct device *device;
+	GSList *l;
+	int index;
+
+	if (!vdev->capturefile) {
+		/* Nothing was recorded from this device. */
+		vdevice_free(vdev);
+		return SIGROK_OK;
+	}
+
+	vdev->sessionfile = g_strdup(filename);
+	vdev->num_probes = g_slist_length(probenames);
+	if (!vdev->unitsize)
+		vdev->unitsize = (vdev->num_probes + 7) / 8;
+	if (vdev->num_probes == 0 || vdev->unitsize == 0
+	    || load_blocks(archive, version, vdev) != SIGROK_OK) {
+		vdevice_free(vdev);
+		return SIGROK_ERR;
+	}
+
+	g_static_mutex_lock(&instances_mutex);
+	index = next_index++;
+	sdi = sigrok_device_instance_new(index, ST_ACTIVE, "Session file",
+					 vdev->capturefile, NULL);
+	if (sdi)
+		all_instances = g_slist_append(all_instances, sdi);
+	g_static_mutex_unlock(&instances_mutex);
+	if (!sdi) {
+		vdevice_free(vdev);
+		return SIGROK_ERR_MALLOC;
+	}
+	sdi->priv = vdev;
+	vdev->file = session->file;
+	session->file->device_instances = g_slist_append(
+				session->file->device_instances, sdi);
+
+	device = device_new(&session_driver, index, 0);
+	for (l = probenames; l; l = l->next)
+		device_probe_add(device, l->data);
+	vdev->device = device;
+
+	return session_device_add(session, device);
+}
+
+static int parse_metadata(struct session *session, const char *filename,
+			  struct zip *archive, int version, char *metadata)
+{
+	struct session_vdevice *vdev;
+	GSList *probenames;
+	char **lines, **kv, *line, name[MAX_PROBENAME_LEN + 1];
+	int probenum, ret, i;
+
+	ret = SIGROK_OK;
+	vdev = NULL;
+	probenames = NULL;
+	lines = g_strsplit(metadata, "\n", 0);
+	for (i = 0; lines[i] && ret == SIGROK_OK; i++) {
+		line = g_strstrip(lines[i]);
+		if (!line[0])
+			continue;
+
+		if (!strcmp(line, "[device]")) {
+			if (vdev)
+				ret = add_vdevice(session, filename, archive,
+						  version, vdev, probenames);
+			g_slist_foreach(probenames, (GFunc)g_free, NULL);
+			g_slist_free(probenames);
+			probenames = NULL;
+			vdev = g_malloc0(sizeof(struct session_vdevice));
+			continue;
+		}
+
+		if (!vdev)
+			/* Nothing outside of a device section yet. */
+			continue;
+
+		if (!strncmp(line, "probe ", 6)) {
+			name[0] = 0;
+			if (sscanf(line, "probe %d name \"%32[^\"]\"",
+				   &probenum, name) < 1)
+				continue;
+			if (!name[0])
+				snprintf(name, sizeof(name), "%d", probenum);
+			probenames = g_slist_append(probenames,
+						    g_strdup(name));
+			continue;
+		}
+
+		kv = g_strsplit(line, "=", 2);
+		if (kv[0] && kv[1]) {
+			g_strstrip(kv[0]);
+			g_strstrip(kv[1]);
+			if (!strcmp(kv[0], "capturefile"))
+				vdev->capturefile = g_strdup(kv[1]);
+			else if (!strcmp(kv[0], "blockindex"))
+				vdev->blockindex = g_strdup(kv[1]);
+			else if (!strcmp(kv[0], "samplerate"))
+				vdev->samplerate = strtoull(kv[1], NULL, 10);
+			else if (!strcmp(kv[0], "unitsize"))
+				vdev->unitsize = strtoul(kv[1], NULL, 10);
+			/* Anything else (driver, ...) is informational. */
+		}
+		g_strfreev(kv);
+	}
+	if (vdev) {
+		if (ret == SIGROK_OK)
+			ret = add_vdevice(session, filename, archive,
+					  version, vdev, probenames);
+		else
+			vdevice_free(vdev);
+	}
+	g_slist_foreach(probenames, (GFunc)g_free, NULL);
+	g_slist_free(probenames);
+	g_strfreev(lines);
+
+	return ret;
+}
+
+/*
+ * Load a session file written by session_save(). This only parses the
+ * metadata and creates the devices; the samples themselves are read lazily
+ * and fed into the session bus once session_start() is called.
+ */
+struct session *session_load(const char *filename)
+{
+	struct session *session;
+	struct zip *archive;
+	char *version, *metadata;
+	int err, ret, vnum;
+
+	if (!(archive = zip_open(filename, 0, &err))) {
+		g_warning("session file: failed to open %s (zip error %d)",
+			  filename, err);
+		return NULL;
+	}
+
+	if (!(version = read_member(archive, "version"))) {
+		g_warning("session file: %s has no version", filename);
+		zip_close(archive);
+		return NULL;
+	}
+	/* Version 1 has one raw member per device, version 2 has blocks. */
+	if (!strcmp(version, "1") || !strcmp(version, "2")) {
+		vnum = version[0] - '0';
+	} else {
+		g_warning("session file: unsupported version %s", version);
+		g_free(version);
+		zip_close(archive);
+		return NULL;
+	}
+	g_free(version);
+
+	if (!(metadata = read_member(archive, "metadata"))) {
+		g_warning("session file: %s has no metadata", filename);
+		zip_close(archive);
+		return NULL;
+	}
+
+	if (!(session = session_new())) {
+		g_free(metadata);
+		zip_close(archive);
+		return NULL;
+	}
+	session->file = g_malloc0(sizeof(struct session_file));
+	ret = parse_metadata(session, filename, archive, vnum, metadata);
+	g_free(metadata);
+	zip_close(archive);
+	if (ret != SIGROK_OK) {
+		g_warning("session file: invalid metadata in %s", filename);
+		session_destroy(session);
+		return NULL;
+	}
+
+	return session;
+}
+
+/* Free the devices session_load() created, with the session. */
+void session_file_free(struct session_file *file)
+{
+	struct sigrok_device_instance *sdi;
+	struct session_vdevice *vdev;
+	GSList *l;
+
+	g_static_mutex_lock(&instances_mutex);
+	for (l = file->device_instances; l; l = l->next)
+		all_instances = g_slist_remove(all_instances, l->data);
+	g_static_mutex_unlock(&instances_mutex);
+
+	for (l = file->device_instances; l; l = l->next) {
+		sdi = l->data;
+		vdev = sdi->priv;
+		if (vdev->device)
+			device_destroy(vdev->device);
+		vdevice_free(vdev);
+		sigrok_device_instance_free(sdi);
+	}
+	g_slist_free(file->device_instances);
+	g_free(file);
+}
+
+/*
+ * Read up to *count units, starting at unit start, of a device created by
+ * session_load() into buf. Only the blocks covering that range are
+ * inflated, so this is cheap anywhere in a large capture. On return, *count
+ * holds the number of units actually read, which is less than requested
+ * when the range runs past the end of the capture.
+ */
+int session_file_read(struct device *device, uint64_t start,
+		      uint64_t *count, void *buf)
+{
+	struct sigrok_device_instance *sdi;
+	struct session_vdevice *vdev;
+	struct zip *archive;
+	struct zip_file *zf;
+	uint64_t done, want;
+	ssize_t ret;
+	int block, err;
+
+	if (device->plugin != &session_driver)
+		return SIGROK_ERR;
+	if (!(sdi = find_instance(device->plugin_index)))
+		return SIGROK_ERR;
+	vdev = sdi->priv;
+
+	done = 0;
+	if ((block = find_block(vdev, start)) == -1) {
+		*count = 0;
+		return SIGROK_OK;
+	}
+
+	if (!(archive = zip_open(vdev->sessionfile, 0, &err)))
+		return SIGROK_ERR;
+
+	zf = open_block(archive, vdev, block,
+			start - vdev->blocks[block].start);
+	while (zf && done < *count) {
+		want = (*count - done) * vdev->unitsize;
+		ret = zip_fread(zf, (char *)buf + done * vdev->unitsize, want);
+		if (ret < 0)
+			break;
+		done += ret / vdev->unitsize;
+		if ((uint64_t)ret < want) {
+			zip_fclose(zf);
+			zf = NULL;
+			if (++block < vdev->num_blocks)
+				zf = open_block(archive, vdev, block, 0);
+		}
+	}
+	if (zf)
+		zip_fclose(zf);
+	zip_close(archive);
+
+	if (done < *count && block < vdev->num_blocks) {
+		/* Ran into a broken block, not the end of the capture. */
+		*count = done;
+		return SIGROK_ERR;
+	}
+	*count = done;
+
+	return SIGROK_OK;
+}
@@ -0,0 +1,557 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2011 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <sigrok.h>
+#include "config.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define USE_EPOLL
+#endif
+
+/* Most events handled per wakeup, the rest come on the next one. */
+#define MAX_EVENTS	16
+
+/*
+ * An event source registered by a driver. The callback is run when the fd
+ * has one of the requested events, or when it had none for timeout ms. A
+ * negative fd, or one that can't be polled, only ever times out.
+ */
+struct source {
+	struct session_loop *loop;
+	/* Key in the loop's sources: the fd, or a unique negative number */
+	int key;
+	int fd;
+	int events;
+	int timeout;
+	receive_data_callback cb;
+	void *user_data;
+	/* Whether the fd is being polled */
+	gboolean polled;
+	/* When the callback is due if nothing happens, in us */
+	int64_t due;
+};
+
+/*
+ * A session's event sources. Everything but session_halt() is only called
+ * from the thread running the session.
+ */
+struct session_loop {
+	/*
+	 * struct source*, by key. There is only ever one source per fd, but
+	 * any number of timer-only sources on negative fds.
+	 */
+	GHashTable *sources;
+	/* Key for the next source on a negative fd */
+	int next_key;
+	/* Sources whose timeout expired, kept around to avoid allocations */
+	GPtrArray *expired;
+	volatile gint halted;
+#ifdef USE_EPOLL
+	int epoll_fd;
+	int timer_fd;
+	/* session_halt() writes to this, to wake up the loop */
+	int wake_fds[2];
+#else
+	/* What g_poll() gets, rebuilt only when the sources change */
+	GArray *pollfds;
+	gboolean pollfds_changed;
+#endif
+};
+
+/* The session whose drivers source_add() and source_remove() work on. */
+static GStaticPrivate current_session = G_STATIC_PRIVATE_INIT;
+
+static int64_t now_us(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void source_free(gpointer data)
+{
+	struct source *s;
+
+	s = data;
+#ifdef USE_EPOLL
+	/* Fails if the driver closed the fd first, which is fine. */
+	if (s->polled)
+		epoll_ctl(s->loop->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+#else
+	s->loop->pollfds_changed = TRUE;
+#endif
+	g_free(s);
+}
+
+#ifdef USE_EPOLL
+static int loop_watch(struct session_loop *loop, int fd, int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = events;
+	ev.data.fd = fd;
+
+	return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+#endif
+
+static struct session_loop *loop_new(void)
+{
+	struct session_loop *loop;
+
+	loop = g_malloc0(sizeof(struct session_loop));
+#ifdef USE_EPOLL
+	loop->epoll_fd = loop->timer_fd = -1;
+	loop->wake_fds[0] = loop->wake_fds[1] = -1;
+	if ((loop->epoll_fd = epoll_create(MAX_EVENTS)) == -1
+	    || (loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1
+	    || pipe(loop->wake_fds) == -1) {
+		g_warning("failed to set up event loop: %s", strerror(errno));
+		session_loop_free(loop);
+		return NULL;
+	}
+	fcntl(loop->wake_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(loop->wake_fds[1], F_SETFL, O_NONBLOCK);
+	loop_watch(loop, loop->timer_fd, EPOLLIN);
+	loop_watch(loop, loop->wake_fds[0], EPOLLIN);
+#else
+	loop->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+#endif
+	loop->sources = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					      NULL, source_free);
+	loop->expired = g_ptr_array_new();
+	loop->next_key = -1;
+
+	return loop;
+}
+
+void session_loop_free(struct session_loop *loop)
+{
+	if (loop->sources)
+		g_hash_table_destroy(loop->sources);
+	if (loop->expired)
+		g_ptr_array_free(loop->expired, TRUE);
+#ifdef USE_EPOLL
+	if (loop->epoll_fd != -1)
+		close(loop->epoll_fd);
+	if (loop->timer_fd != -1)
+		close(loop->timer_fd);
+	if (loop->wake_fds[0] != -1) {
+		close(loop->wake_fds[0]);
+		close(loop->wake_fds[1]);
+	}
+#else
+	g_array_free(loop->pollfds, TRUE);
+#endif
+	g_free(loop);
+}
+
+static struct session_loop *session_loop(struct session *session)
+{
+	if (!session->loop)
+		session->loop = loop_new();
+
+	return session->loop;
+}
+
+/*
+ * Make this thread's source_add() and source_remove() calls go to the given
+ * session. Done by the session while it calls into the drivers.
+ */
+void session_set_current(struct session *session)
+{
+	g_static_private_set(&current_session, session, NULL);
+}
+
+struct session *session_current(void)
+{
+	return g_static_private_get(&current_session);
+}
+
+/*
+ * Find the source on fd with the given callback and user_data. A NULL
+ * callback matches any source on fd.
+ */
+static struct source *find_source(struct session_loop *loop, int fd,
+				  receive_data_callback callback,
+				  void *user_data)
+{
+	GHashTableIter iter;
+	struct source *s;
+	gpointer value;
+
+	if (fd >= 0) {
+		s = g_hash_table_lookup(loop->sources, GINT_TO_POINTER(fd));
+		if (s && callback && (s->cb != callback
+				      || s->user_data != user_data))
+			return NULL;
+		return s;
+	}
+
+	/* Several devices may have timer-only sources on the same fd. */
+	g_hash_table_iter_init(&iter, loop->sources);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		s = value;
+		if (s->fd == fd && (!callback || (s->cb == callback
+				    && s->user_data == user_data)))
+			return s;
+	}
+
+	return NULL;
+}
+
+/*
+ * Run callback when fd has any of events, or when nothing happened on it for
+ * timeout ms, unless that is -1. A negative fd only times out. This replaces
+ * any source the session already has on fd, or on a negative fd, the one
+ * with the same callback and user_data.
+ */
+int session_source_add(struct session *session, int fd, int events,
+		       int timeout, receive_data_callback callback,
+		       void *user_data)
+{
+	struct session_loop *loop;
+	struct source *s;
+
+	if (!(loop = session_loop(session)))
+		return SIGROK_ERR;
+
+	if (fd >= 0)
+		session_source_remove(session, fd, NULL, NULL);
+	else
+		session_source_remove(session, fd, callback, user_data);
+
+	s = g_malloc0(sizeof(struct source));
+	s->loop = loop;
+	s->key = fd >= 0 ? fd : loop->next_key--;
+	s->fd = fd;
+	s->events = events;
+	s->timeout = timeout;
+	s->cb = callback;
+	s->user_data = user_data;
+	if (timeout >= 0)
+		s->due = now_us() + (int64_t)timeout * 1000;
+
+	if (fd >= 0) {
+#ifdef USE_EPOLL
+		/* On Linux, G_IO_* have the same values as EPOLL*. */
+		if (loop_watch(loop, fd, events) == 0)
+			s->polled = TRUE;
+		else
+			/* Regular files, for example. */
+			g_message("can't poll fd %d: %s", fd, strerror(errno));
+#else
+		s->polled = TRUE;
+		loop->pollfds_changed = TRUE;
+#endif
+	}
+	if (!s->polled && timeout < 0)
+		g_warning("source on fd %d will never be run", fd);
+
+	g_hash_table_insert(loop->sources, GINT_TO_POINTER(s->key), s);
+
+	return SIGROK_OK;
+}
+
+/*
+ * Remove the source on fd that was added with callback and user_data. With
+ * a NULL callback, every source on fd goes.
+ */
+int session_source_remove(struct session *session, int fd,
+			  receive_data_callback callback, void *user_data)
+{
+	struct source *s;
+	int ret;
+
+	if (!session->loop)
+		return SIGROK_ERR;
+
+	ret = SIGROK_ERR;
+	while ((s = find_source(session->loop, fd, callback, user_data))) {
+		g_hash_table_remove(session->loop->sources,
+				    GINT_TO_POINTER(s->key));
+		ret = SIGROK_OK;
+	}
+
+	return ret;
+}
+
+/* Drop all sources, e.g. those left behind by drivers. */
+void session_source_clear(struct session *session)
+{
+	if (session->loop)
+		g_hash_table_remove_all(session->loop->sources);
+}
+
+static void run_source(struct source *s, int revents)
+{
+	if (s->timeout >= 0)
+		s->due = now_us() + (int64_t)s->timeout * 1000;
+	s->cb(s->fd, revents, s->user_data);
+}
+
+/*
+ * Time left until the next source is due, in us: 0 if one is already
+ * overdue, -1 if no source has a timeout.
+ */
+static int64_t next_timeout(struct session_loop *loop, int64_t now)
+{
+	GHashTableIter iter;
+	struct source *s;
+	int64_t next;
+	gpointer value;
+
+	next = -1;
+	g_hash_table_iter_init(&iter, loop->sources);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		s = value;
+		if (s->timeout < 0)
+			continue;
+		if (s->due <= now)
+			return 0;
+		if (next == -1 || s->due - now < next)
+			next = s->due - now;
+	}
+
+	return next;
+}
+
+/* Run the sources that had nothing happen for their timeout. */
+static void run_expired(struct session_loop *loop)
+{
+	GHashTableIter iter;
+	struct source *s;
+	gpointer value;
+	int64_t now;
+	unsigned int i;
+
+	/* Callbacks may add or remove sources, so collect them first. */
+	now = now_us();
+	g_ptr_array_set_size(loop->expired, 0);
+	g_hash_table_iter_init(&iter, loop->sources);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		s = value;
+		if (s->timeout >= 0 && s->due <= now)
+			g_ptr_array_add(loop->expired, s);
+	}
+
+	for (i = 0; i < loop->expired->len; i++) {
+		if (g_atomic_int_get(&loop->halted))
+			break;
+		s = g_ptr_array_index(loop->expired, i);
+		/* Unless an earlier callback removed it. */
+		if (g_hash_table_lookup(loop->sources, GINT_TO_POINTER(s->key))
+		    == s)
+			run_source(s, 0);
+	}
+}
+
+#ifdef USE_EPOLL
+/* Wait for events, with the timer armed for the next source due. */
+static int wait_events(struct session_loop *loop, gboolean block,
+		       struct epoll_event *events)
+{
+	struct itimerspec its;
+	int64_t timeout;
+	int num;
+
+	timeout = block ? next_timeout(loop, now_us()) : 0;
+	if (timeout > 0) {
+		memset(&its, 0, sizeof(struct itimerspec));
+		its.it_value.tv_sec = timeout / 1000000;
+		its.it_value.tv_nsec = (timeout % 1000000) * 1000;
+		timerfd_settime(loop->timer_fd, 0, &its, NULL);
+	}
+
+	/* Don't sleep at all if a source is overdue already. */
+	num = epoll_wait(loop->epoll_fd, events, MAX_EVENTS,
+			 timeout ? -1 : 0);
+	if (num == -1 && errno == EINTR)
+		num = 0;
+
+	return num;
+}
+
+static int loop_iteration(struct session_loop *loop, gboolean block)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct source *s;
+	uint64_t buf;
+	int num, fd, i;
+
+	if ((num = wait_events(loop, block, events)) == -1) {
+		g_warning("epoll_wait failed: %s", strerror(errno));
+		return SIGROK_ERR;
+	}
+
+	for (i = 0; i < num && !g_atomic_int_get(&loop->halted); i++) {
+		fd = events[i].data.fd;
+		if (fd == loop->timer_fd || fd == loop->wake_fds[0]) {
+			/* Only there to wake us up. */
+			while (read(fd, &buf, sizeof(buf)) > 0
+			       && fd == loop->wake_fds[0])
+				;
+			continue;
+		}
+		/* An earlier callback may have removed it. */
+		s = g_hash_table_lookup(loop->sources, GINT_TO_POINTER(fd));
+		if (s)
+			run_source(s, events[i].events);
+	}
+
+	return SIGROK_OK;
+}
+#else
+static int loop_iteration(struct session_loop *loop, gboolean block)
+{
+	GHashTableIter iter;
+	GPollFD *fd;
+	struct source *s;
+	gpointer value;
+	int64_t timeout;
+	unsigned int i;
+	int num;
+
+	if (loop->pollfds_changed) {
+		g_array_set_size(loop->pollfds, 0);
+		g_hash_table_iter_init(&iter, loop->sources);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			s = value;
+			if (!s->polled)
+				continue;
+			g_array_set_size(loop->pollfds, loop->pollfds->len + 1);
+			fd = &g_array_index(loop->pollfds, GPollFD,
+					    loop->pollfds->len - 1);
+			fd->fd = s->fd;
+			fd->events = s->events;
+		}
+		loop->pollfds_changed = FALSE;
+	}
+
+	/* session_halt() can't wake this up, it takes effect on an event. */
+	timeout = block ? next_timeout(loop, now_us()) : 0;
+	num = g_poll((GPollFD *)loop->pollfds->data, loop->pollfds->len,
+		     timeout < 0 ? -1 : (timeout + 999) / 1000);
+
+	for (i = 0; num > 0 && i < loop->pollfds->len; i++) {
+		if (g_atomic_int_get(&loop->halted))
+			break;
+		fd = &g_array_index(loop->pollfds, GPollFD, i);
+		if (!fd->revents)
+			continue;
+		/* An earlier callback may have removed it. */
+		s = g_hash_table_lookup(loop->sources,
+					GINT_TO_POINTER(fd->fd));
+		if (s)
+			run_source(s, fd->revents);
+	}
+
+	return SIGROK_OK;
+}
+#endif
+
+/*
+ * Wait for something to happen on the session's sources, or for the next
+ * one to time out, and run their callbacks. With block FALSE, only what is
+ * ready right now is run. This is for frontends that have an event loop of
+ * their own; others just call session_run().
+ */
+int session_run_iteration(struct session *session, int block)
+{
+	struct session_loop *loop;
+	int ret;
+
+	if (!(loop = session_loop(session)))
+		return SIGROK_ERR;
+
+	session_set_current(session);
+	ret = loop_iteration(loop, block);
+	if (ret == SIGROK_OK && !g_atomic_int_get(&loop->halted))
+		run_expired(loop);
+	session_set_current(NULL);
+
+	return ret;
+}
+
+/*
+ * Run the session's sources until session_halt() is called, or none are
+ * left. Called after session_start(), from the same thread.
+ */
+int session_run(struct session *session)
+{
+	struct session_loop *loop;
+	int ret;
+
+	if (!(loop = session_loop(session)))
+		return SIGROK_ERR;
+
+	ret = SIGROK_OK;
+	while (ret == SIGROK_OK && !g_atomic_int_get(&loop->halted)
+	       && g_hash_table_size(loop->sources))
+		ret = session_run_iteration(session, TRUE);
+
+	return ret;
+}
+
+/*
+ * Make session_run() return, e.g. when the frontend has all the samples it
+ * wants. This may be called from any thread, such as a datafeed callback's.
+ */
+void session_halt(struct session *session)
+{
+	struct session_loop *loop;
+
+	if (!(loop = session->loop))
+		return;
+
+	g_atomic_int_set(&loop->halted, 1);
+#ifdef USE_EPOLL
+	if (write(loop->wake_fds[1], "", 1) == -1 && errno != EAGAIN)
+		g_warning("failed to wake up event loop: %s",
+			  strerror(errno));
+#endif
+}
+
+/* Called by session_start(), to run the sources again. */
+void session_loop_reset(struct session *session)
+{
+	if (session->loop)
+		g_atomic_int_set(&session->loop->halted, 0);
+}
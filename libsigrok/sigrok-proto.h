@@ -24,6 +24,20 @@
 int filter_probes(int in_unitsize, int out_unitsize, int *probelist,
 		  char *data_in, uint64_t length_in, char **data_out,
 		  uint64_t *length_out);
+int filter_new(int in_unitsize, int out_unitsize, int *probelist,
+	       struct probe_filter **filter);
+void filter_destroy(struct probe_filter *filter);
+int filter_run(struct probe_filter *filter, char *data_in,
+	       uint64_t length_in, char **data_out, uint64_t *length_out);
+int filter_run_into(struct probe_filter *filter, char *data_in,
+		    uint64_t length_in, char *data_out, uint64_t *length_out);
+
+int soft_trigger_new(struct trigger *trigger, int unitsize,
+		     uint64_t samplerate, struct soft_trigger **soft);
+void soft_trigger_destroy(struct soft_trigger *trigger);
+void soft_trigger_reset(struct soft_trigger *trigger);
+int64_t soft_trigger_run(struct soft_trigger *trigger, const uint8_t *buf,
+			 uint64_t len);
 
 char *sigrok_samplerate_string(uint64_t samplerate);
 char *sigrok_period_string(uint64_t frequency);
@@ -54,6 +68,7 @@ struct probe *probe_find(struct device *device, int probenum);
 void device_probe_name(struct device *device, int probenum, char *name);
 
 struct trigger *device_trigger_add(struct device *device, int type, unsigned int list_len);
+gboolean device_trigger_supported(struct device *device, int type);
 
 int load_hwplugins(void);
 GSList *list_hwplugins(void);
@@ -78,38 +93,69 @@ void serial_device_instance_free(struct serial_device_instance *serial);
 int find_hwcap(int *capabilities, int hwcap);
 struct hwcap_option *find_hwcap_option(int hwcap);
 void source_remove(int fd);
+void source_remove_callback(int fd, receive_data_callback rcv_cb,
+			    void *user_data);
 void source_add(int fd, int events, int timeout, receive_data_callback rcv_cb,
 		void *user_data);
 
 /*--- session.c -------------------------------------------------------------*/
 
-typedef void (*source_callback_remove) (int fd);
-typedef void (*source_callback_add) (int fd, int events, int timeout,
-		receive_data_callback callback, void *user_data);
 typedef void (*datafeed_callback) (struct device *device,
 				 struct datafeed_packet *packet);
 
 /* Session setup */
-struct session *session_load(const char *filename);
 struct session *session_new(void);
-void session_destroy(void);
-void session_device_clear(void);
-int session_device_add(struct device *device);
+void session_destroy(struct session *session);
+void session_device_clear(struct session *session);
+int session_device_add(struct session *session, struct device *device);
+int session_device_context_set(struct device *device, void *data,
+			       GDestroyNotify destroy);
+void *session_device_context_get(struct device *device);
 
 /* Protocol analyzers setup */
-void session_pa_clear(void);
-void session_pa_add(struct analyzer *pa);
+void session_pa_clear(struct session *session);
+void session_pa_add(struct session *session, struct analyzer *pa);
 
 /* Datafeed setup */
-void session_datafeed_callback_clear(void);
-void session_datafeed_callback_add(datafeed_callback callback);
+void session_datafeed_callback_clear(struct session *session);
+void session_datafeed_callback_add(struct session *session,
+				    datafeed_callback callback);
+int session_bus_threaded(struct session *session, unsigned int queue_len,
+			 int policy);
+uint64_t session_bus_overruns(struct session *session);
+void session_pretrigger_set(struct session *session, uint64_t samples);
 
 /* Session control */
-int session_start(void);
-void session_stop(void);
+int session_start(struct session *session);
+void session_stop(struct session *session);
 void session_bus(struct device *device, struct datafeed_packet *packet);
-void make_metadata(char *filename);
-int session_save(char *filename);
+void make_metadata(struct session *session, char *filename);
+int session_save(struct session *session, char *filename);
+
+/*--- session_loop.c --------------------------------------------------------*/
+
+int session_source_add(struct session *session, int fd, int events,
+		       int timeout, receive_data_callback callback,
+		       void *user_data);
+int session_source_remove(struct session *session, int fd,
+			  receive_data_callback callback, void *user_data);
+void session_source_clear(struct session *session);
+int session_run_iteration(struct session *session, int block);
+int session_run(struct session *session);
+void session_halt(struct session *session);
+
+/* For use by the session and drivers */
+void session_set_current(struct session *session);
+struct session *session_current(void);
+void session_loop_reset(struct session *session);
+void session_loop_free(struct session_loop *loop);
+
+/*--- session_file.c --------------------------------------------------------*/
+
+struct session *session_load(const char *filename);
+void session_file_free(struct session_file *file);
+int session_file_read(struct device *device, uint64_t start,
+		      uint64_t *count, void *buf);
 
 /*--- hwcommon.c ------------------------------------------------------------*/
 
@@ -138,12 +184,29 @@ int opendev3(struct sigrok_device_instance **sdi, libusb_device *dev,
 	     struct libusb_device_descriptor *des,
 	     uint16_t vid, uint16_t pid, int interface);
 
+/*--- bufferpool.c ----------------------------------------------------------*/
+
+struct packet_buffer *packet_buffer_new(uint64_t size);
+struct packet_buffer *packet_buffer_from_data(void *data);
+void packet_buffer_ref(struct packet_buffer *buf);
+void packet_buffer_unref(struct packet_buffer *buf);
+int packet_buffer_pool_prealloc(uint64_t size, int count);
+void packet_buffer_pool_cleanup(void);
+
 /*--- datastore.c -----------------------------------------------------------*/
 
-int datastore_new(int unitsize, struct datastore **ds);
+int datastore_new(int unitsize, int flags, struct datastore **ds);
 int datastore_destroy(struct datastore *ds);
-void datastore_put(struct datastore *ds, void *data, unsigned int length,
-		   int in_unitsize, int *probelist);
+int datastore_put(struct datastore *ds, void *data, uint64_t length,
+		  int in_unitsize, int *probelist);
+int datastore_get(struct datastore *ds, uint64_t start, uint64_t count,
+		  void *buf);
+int datastore_put_run(struct datastore *ds, void *unit, uint64_t count);
+void *datastore_get_ptr(struct datastore *ds, uint64_t start, uint64_t *count);
+int datastore_get_bitplane(struct datastore *ds, int probe, uint64_t start,
+			   uint64_t count, uint64_t *buf);
+uint64_t *datastore_get_bitplane_ptr(struct datastore *ds, int probe,
+				     uint64_t start, uint64_t *count);
 
 
 #endif /* SIGROK_PROTO_H_ */
@@ -108,6 +108,35 @@ struct datafeed_packet {
 	uint64_t length;
 	uint16_t unitsize;
 	void *payload;
+	/*
+	 * For DF_LOGIC, DF_ANALOG and DF_PD, the pooled buffer holding the
+	 * payload, or NULL if it isn't in one. Callbacks that want to keep
+	 * the samples around after returning can take a reference on it.
+	 */
+	struct packet_buffer *buffer;
+};
+
+/* Reference counted sample buffer, from packet_buffer_new(). */
+struct packet_buffer {
+	int refcount;
+	/* Pool size class, or -1 if not pooled */
+	int size_class;
+	/* Usable size of data, in bytes */
+	uint64_t size;
+	void *data;
+	/* Next buffer on the pool's free list */
+	struct packet_buffer *next;
+};
+
+/* Payload of DF_PD packets, an analyzer's output */
+struct datafeed_pd {
+	struct analyzer *analyzer;
+	/* The samples decoded, counted from the device's DF_HEADER */
+	uint64_t start_sample;
+	uint64_t num_samples;
+	/* Length of data */
+	uint64_t length;
+	uint8_t data[];
 };
 
 struct datafeed_header {
@@ -119,6 +148,30 @@ struct datafeed_header {
 	int num_logic_probes;
 };
 
+/*
+ * Probe filter, prepared once by filter_new() for a given list of probes
+ * and run on every DF_LOGIC packet by filter_run().
+ */
+struct probe_filter {
+	int in_unitsize;
+	int out_unitsize;
+	int num_probes;
+	/* Input bytes holding at least one enabled probe */
+	int num_bytes;
+	int bytes[8];
+	/* Output bits set by every value of each of those input bytes */
+	uint64_t lut[8][256];
+	/* Enabled probes as a bit mask, used with BMI2 PEXT */
+	uint64_t mask;
+	/* Set if the probes are in ascending order and the CPU has PEXT */
+	int use_pext;
+	/* Set if all probes are used in order, so nothing needs to be done */
+	int identity;
+	/* Output buffer reused by filter_run() */
+	char *buf;
+	uint64_t buf_size;
+};
+
 
 
 struct input {
@@ -159,6 +212,16 @@ struct output_format {
 struct analyzer {
 	char *name;
 	char *filename;
+	/*
+	 * Called with every packet on the bus, in order. Anything returned in
+	 * out is sent on as a DF_PD packet. out stays the analyzer's, and
+	 * only needs to be valid until the next call.
+	 */
+	int (*decode) (struct analyzer *an, struct device *device,
+		       struct datafeed_packet *packet, uint8_t **out,
+		       uint64_t *out_len);
+	/* For the analyzer's own use */
+	void *internal;
 	/*
 	 * TODO: Parameters? If so, configured plugins need another struct.
 	 * TODO: Input and output format?
@@ -169,11 +232,52 @@ struct analyzer {
 /* Size of a chunk in units */
 #define DATASTORE_CHUNKSIZE 512000
 
+/* Number of 64-sample words in a bit-plane of one probe in a chunk */
+#define DATASTORE_PLANE_WORDS (DATASTORE_CHUNKSIZE / 64)
+
+/* datastore_new() flags */
+enum {
+	/* Keep the chunks in a memory-mapped temporary file */
+	DATASTORE_MMAP = (1 << 0),
+	/* Also keep every probe's samples as a bit-plane, see below */
+	DATASTORE_BITPLANES = (1 << 1),
+	/* Only store where the samples change, for units up to 8 bytes */
+	DATASTORE_RLE = (1 << 2),
+};
+
+/* With DATASTORE_RLE, unit value from unit number start on */
+struct datastore_run {
+	uint64_t start;
+	uint64_t value;
+};
+
 struct datastore {
 	/* Size in bytes of the number of units stored in this datastore */
 	int ds_unitsize;
-	unsigned int num_units; /* TODO: uint64_t */
-	GSList *chunklist;
+	int flags;
+	/* Backing file for DATASTORE_MMAP, -1 otherwise */
+	int fd;
+	uint64_t num_units;
+	/* Chunks of DATASTORE_CHUNKSIZE units each, indexed by unit number */
+	void **chunks;
+	unsigned int num_chunks;
+	/* Number of slots allocated in the chunks array */
+	unsigned int chunks_size;
+	/*
+	 * With DATASTORE_BITPLANES, one block per chunk holding the chunk's
+	 * samples probe by probe: DATASTORE_PLANE_WORDS words for the first
+	 * probe, then for the second one and so on. Bit n of a word is the
+	 * probe's value in the word's n-th sample.
+	 */
+	uint64_t **planes;
+	/*
+	 * With DATASTORE_RLE, no chunks are used. Instead, every change in
+	 * unit value is recorded here; a run lasts until the next one starts.
+	 */
+	struct datastore_run *runs;
+	uint64_t num_runs;
+	/* Number of slots allocated in the runs array */
+	uint64_t runs_size;
 };
 
 
@@ -194,6 +298,8 @@ struct device {
 	GSList *triggers;
 	/* Data acquired by this device, if any */
 	struct datastore *datastore;
+	/* Session this device is in, if any */
+	struct session *session;
 };
 
 enum {
@@ -253,14 +359,21 @@ struct trigger_count {
 };
 struct trigger_serial {
 	struct probe *probe;
+	/* Number of bits in the pattern */
 	uint8_t n;
+	/* Clock probe index, or 0 to sample at clock bits per second */
 	uint8_t clock_source;
 	uint64_t clock;
 	uint64_t value;
 	uint64_t mask;
 };
-struct trigger_proto { /* FIXME */
-	struct protocol *proto;
+/*
+ * Fires when the output of the analyzer with the given name matches the
+ * pattern, see g_pattern_match_simple().
+ */
+struct trigger_proto {
+	char *analyzer;
+	char *pattern;
 };
 
 struct trigger {
@@ -276,6 +389,53 @@ struct trigger {
 	};
 };
 
+/* Most stages a software trigger handles */
+#define SOFT_TRIGGER_STAGES 16
+
+/*
+ * Software trigger, prepared by soft_trigger_new() from a logic, edge,
+ * width, count or serial trigger and run on every buffer of samples by
+ * soft_trigger_run().
+ */
+struct soft_trigger {
+	int type;
+	int unitsize;
+	int num_stages;
+	/* Values are already masked */
+	uint64_t mask[SOFT_TRIGGER_STAGES];
+	uint64_t value[SOFT_TRIGGER_STAGES];
+	/* The last samples of earlier buffers, for matches across them */
+	uint8_t history[SOFT_TRIGGER_STAGES * 8];
+	int num_history;
+	/* Edge, width and count triggers: the probe's bit and settings */
+	uint64_t bit;
+	int direction;
+	int mol;
+	/* Pulse width limit, in samples */
+	uint64_t width;
+	unsigned int count;
+	/* Probe level in the last sample seen, -1 before the first one */
+	int level;
+	/* Samples at that level so far, valid once an edge started them */
+	uint64_t run;
+	gboolean run_valid;
+	/* Rising edges counted so far */
+	unsigned int edges;
+	/* Serial triggers: clock probe's bit, 0 for a fixed bit rate */
+	uint64_t clock_bit;
+	/* Pattern length and the bits shifted in so far */
+	unsigned int bits;
+	unsigned int num_bits;
+	uint64_t shift;
+	/* Bit period and next sampling point, 16.16 fixed point samples */
+	uint64_t period;
+	uint64_t next_point;
+	/* Samples seen so far */
+	uint64_t position;
+	/* The samples that matched, once the trigger fired */
+	uint8_t matched[SOFT_TRIGGER_STAGES * 8];
+};
+
 extern GSList *devices;
 
 
@@ -293,6 +453,9 @@ enum {
 	HWCAP_TRIGGERCONFIG,	 /* Configure triggers */
 	HWCAP_CAPTURE_RATIO,     /* Set pre/post-trigger capture ratio */
 	HWCAP_PATTERN_MODE,      /* Pattern generator mode */
+	HWCAP_USB_THREAD,        /* Handle USB events in a thread of its own */
+	HWCAP_USB_TRANSFERS,     /* Number of USB transfers kept in flight */
+	HWCAP_USB_TRANSFER_SIZE, /* Size of each USB transfer, in bytes */
 
 	/* acquisition modes */
 	HWCAP_LIMIT_MSEC,        /* Set a time limit for sample acquisition */
@@ -410,6 +573,19 @@ struct gsource_fd {
 	GSource *timeout_source;
 };
 
+/* session_bus_threaded() policies for when a callback's queue is full */
+enum {
+	/* Wait for the callback to catch up */
+	BUS_QUEUE_BLOCK,
+	/* Throw away the oldest queued samples */
+	BUS_QUEUE_DROP_OLDEST,
+	/* Throw away the new samples, and count them as overruns */
+	BUS_QUEUE_DROP_NEWEST,
+};
+
+struct session_loop;
+struct session_file;
+
 struct session {
 	/* List of struct device* */
 	GSList *devices;
@@ -418,6 +594,36 @@ struct session {
 	/* Datafeed callbacks */
 	GSList *datafeed_callbacks;
 	GTimeVal starttime;
+	/* Queue length per callback in threaded bus mode, 0 if not used */
+	unsigned int bus_queue_len;
+	int bus_policy;
+	/* List of struct bus_queue*, one per callback, while running */
+	GSList *bus_queues;
+	/* Packets dropped in threaded bus mode */
+	uint64_t bus_overruns;
+	/* Frontend state, struct device* -> struct device_context* */
+	GHashTable *device_contexts;
+	/* Queue feeding the analyzer thread, while running */
+	struct bus_queue *pa_queue;
+	/* Samples each device sent, struct device* -> uint64_t* */
+	GHashTable *pa_positions;
+	/* Protects the device list and the device contexts */
+	GMutex *mutex;
+	/* Serializes producers, i.e. drivers, in threaded bus mode */
+	GMutex *bus_mutex;
+	/*
+	 * Same for the analyzer queue. This one is separate, as the analyzer
+	 * thread feeds the callbacks' queues while drivers wait for it.
+	 */
+	GMutex *pa_mutex;
+	/* The sources drivers added, see session_loop.c */
+	struct session_loop *loop;
+	/* Trigger state, struct device* -> struct bus_trigger* */
+	GHashTable *triggers;
+	/* Samples to keep from before a trigger, 0 to keep them all */
+	uint64_t pretrigger;
+	/* Devices loaded by session_load(), see session_file.c */
+	struct session_file *file;
 };
 
 #include "sigrok-proto.h"
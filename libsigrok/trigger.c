@@ -0,0 +1,584 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2011 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include <sigrok.h>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TRIGGER_SSE2
+#endif
+
+/*
+ * Software trigger for drivers whose hardware has none. A trigger_logic
+ * with n stages fires on n consecutive samples, where sample i matches
+ * stage i under its mask. Stages stop at the first one with an empty mask.
+ */
+static int logic_new(struct soft_trigger *t, struct trigger_logic *logic)
+{
+	int i;
+
+	if (logic->n > SOFT_TRIGGER_STAGES)
+		return SIGROK_ERR;
+
+	for (i = 0; i < logic->n && logic->mask[i]; i++) {
+		t->mask[i] = logic->mask[i];
+		/* Bits outside the mask would never match. */
+		t->value[i] = logic->value[i] & logic->mask[i];
+	}
+	t->num_stages = i;
+
+	return SIGROK_OK;
+}
+
+/*
+ * Edge, width and count triggers follow the level of a single probe, and
+ * fire on one sample: the edge, the edge ending a short enough pulse, the
+ * first sample of a pulse that got too long, or the count'th rising edge.
+ */
+static int probe_bit(struct soft_trigger *t, struct probe *probe)
+{
+	if (!probe || probe->index < 1 || probe->index > t->unitsize * 8)
+		return SIGROK_ERR;
+	t->bit = 1ULL << (probe->index - 1);
+	t->num_stages = 1;
+
+	return SIGROK_OK;
+}
+
+/*
+ * Serial triggers shift the data probe's level into a register on every
+ * rising edge of the clock probe, or if clock_source is 0, once per bit
+ * period at the given bit rate. The bit period is then resynchronized on
+ * every edge of the data probe, sampling in the middle of a bit. The first
+ * bit received ends up the most significant one of the n bit pattern.
+ */
+static int serial_new(struct soft_trigger *t, struct trigger_serial *serial,
+		      uint64_t samplerate)
+{
+	uint64_t bits;
+
+	if (probe_bit(t, serial->probe) != SIGROK_OK)
+		return SIGROK_ERR;
+	if (serial->n < 1 || serial->n > 64)
+		return SIGROK_ERR;
+
+	t->bits = serial->n;
+	bits = t->bits == 64 ? ~0ULL : (1ULL << t->bits) - 1;
+	t->mask[0] = serial->mask ? serial->mask & bits : bits;
+	t->value[0] = serial->value & t->mask[0];
+
+	if (serial->clock_source) {
+		if (serial->clock_source > t->unitsize * 8)
+			return SIGROK_ERR;
+		t->clock_bit = 1ULL << (serial->clock_source - 1);
+	} else {
+		if (!serial->clock || serial->clock > samplerate)
+			return SIGROK_ERR;
+		/* Samples per bit, 16.16 fixed point */
+		t->period = (samplerate << 16) / serial->clock;
+	}
+
+	return SIGROK_OK;
+}
+
+/*
+ * The samplerate is only needed for width triggers, to turn their time
+ * limit into a number of samples, and for serial triggers without a clock
+ * probe.
+ */
+int soft_trigger_new(struct trigger *trigger, int unitsize,
+		     uint64_t samplerate, struct soft_trigger **soft)
+{
+	struct soft_trigger *t;
+	int ret;
+
+	if (unitsize < 1 || unitsize > 8)
+		return SIGROK_ERR;
+
+	if (!(t = g_try_malloc0(sizeof(struct soft_trigger))))
+		return SIGROK_ERR_MALLOC;
+	t->type = trigger->type;
+	t->unitsize = unitsize;
+
+	switch (trigger->type) {
+	case TRIGGER_TYPE_LOGIC:
+		ret = logic_new(t, trigger->logic);
+		break;
+	case TRIGGER_TYPE_EDGE:
+		ret = probe_bit(t, trigger->edge->probe);
+		t->direction = trigger->edge->direction;
+		break;
+	case TRIGGER_TYPE_WIDTH:
+		ret = probe_bit(t, trigger->width->probe);
+		if (!samplerate)
+			ret = SIGROK_ERR;
+		t->direction = trigger->width->direction;
+		t->mol = trigger->width->mol;
+		t->width = (double)trigger->width->psecs * samplerate
+			   / 1000000000000.0 + 0.5;
+		break;
+	case TRIGGER_TYPE_COUNT:
+		ret = probe_bit(t, trigger->count->probe);
+		t->count = MAX(trigger->count->count, 1);
+		break;
+	case TRIGGER_TYPE_SERIAL:
+		ret = serial_new(t, trigger->serial, samplerate);
+		break;
+	default:
+		ret = SIGROK_ERR;
+		break;
+	}
+	if (ret != SIGROK_OK) {
+		g_free(t);
+		return ret;
+	}
+	soft_trigger_reset(t);
+
+	*soft = t;
+
+	return SIGROK_OK;
+}
+
+void soft_trigger_destroy(struct soft_trigger *trigger)
+{
+	g_free(trigger);
+}
+
+/* Forget about samples seen so far, e.g. for a new acquisition. */
+void soft_trigger_reset(struct soft_trigger *trigger)
+{
+	trigger->num_history = 0;
+	trigger->level = -1;
+	trigger->run = 0;
+	trigger->run_valid = FALSE;
+	trigger->edges = 0;
+	trigger->shift = 0;
+	trigger->num_bits = 0;
+	trigger->position = 0;
+	trigger->next_point = trigger->period / 2;
+}
+
+static inline uint64_t unit_load(const uint8_t *p, int unitsize)
+{
+	uint64_t v64;
+	uint32_t v32;
+	uint16_t v16;
+
+	switch (unitsize) {
+	case 1:
+		return p[0];
+	case 2:
+		memcpy(&v16, p, 2);
+		return v16;
+	case 4:
+		memcpy(&v32, p, 4);
+		return v32;
+	case 8:
+		memcpy(&v64, p, 8);
+		return v64;
+	default:
+		v64 = 0;
+		memcpy(&v64, p, unitsize);
+		return v64;
+	}
+}
+
+/* Whether the stages from first on match the samples from p on. */
+static int match_stages(struct soft_trigger *t, const uint8_t *p, int first)
+{
+	int i;
+
+	for (i = first; i < t->num_stages; i++) {
+		if ((unit_load(p, t->unitsize) & t->mask[i]) != t->value[i])
+			return FALSE;
+		p += t->unitsize;
+	}
+
+	return TRUE;
+}
+
+/* First sample from start up to end that matches value under mask. */
+static uint64_t find_first(int unitsize, const uint8_t *buf, uint64_t start,
+			   uint64_t end, uint64_t m, uint64_t v)
+{
+	for (; start < end; start++) {
+		if ((unit_load(buf + start * unitsize, unitsize) & m) == v)
+			break;
+	}
+
+	return start;
+}
+
+#ifdef TRIGGER_SSE2
+/*
+ * Same as find_first(), comparing 16 bytes worth of samples at a time. The
+ * compare sets all bytes of a matching sample, so only the first byte's
+ * bit in the movemask result is looked at.
+ */
+static uint64_t find_first_sse2(int unitsize, const uint8_t *buf,
+				uint64_t start, uint64_t end, uint64_t m,
+				uint64_t v)
+{
+	__m128i mask, value, x, eq;
+	unsigned int bits, select;
+	int per_block;
+
+	switch (unitsize) {
+	case 1:
+		mask = _mm_set1_epi8(m);
+		value = _mm_set1_epi8(v);
+		select = 0xffff;
+		break;
+	case 2:
+		mask = _mm_set1_epi16(m);
+		value = _mm_set1_epi16(v);
+		select = 0x5555;
+		break;
+	case 4:
+		mask = _mm_set1_epi32(m);
+		value = _mm_set1_epi32(v);
+		select = 0x1111;
+		break;
+	case 8:
+		mask = _mm_set1_epi64x(m);
+		value = _mm_set1_epi64x(v);
+		select = 0x0101;
+		break;
+	default:
+		return find_first(unitsize, buf, start, end, m, v);
+	}
+
+	per_block = 16 / unitsize;
+	while (start + per_block <= end) {
+		x = _mm_loadu_si128((const __m128i *)(buf + start * unitsize));
+		x = _mm_and_si128(x, mask);
+		switch (unitsize) {
+		case 1:
+			eq = _mm_cmpeq_epi8(x, value);
+			break;
+		case 2:
+			eq = _mm_cmpeq_epi16(x, value);
+			break;
+		case 4:
+			eq = _mm_cmpeq_epi32(x, value);
+			break;
+		default:
+			/* No 64-bit compare in SSE2: both halves must match. */
+			eq = _mm_cmpeq_epi32(x, value);
+			eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq,
+						_MM_SHUFFLE(2, 3, 0, 1)));
+			break;
+		}
+		if ((bits = _mm_movemask_epi8(eq) & select))
+			return start + __builtin_ctz(bits) / unitsize;
+		start += per_block;
+	}
+
+	return find_first(unitsize, buf, start, end, m, v);
+}
+#endif
+
+static inline uint64_t find_sample(struct soft_trigger *t, const uint8_t *buf,
+				   uint64_t start, uint64_t end, uint64_t m,
+				   uint64_t v)
+{
+#ifdef TRIGGER_SSE2
+	return find_first_sse2(t->unitsize, buf, start, end, m, v);
+#else
+	return find_first(t->unitsize, buf, start, end, m, v);
+#endif
+}
+
+/* Whether an edge to, or a pulse at, the given level is wanted. */
+static int direction_matches(int direction, int high)
+{
+	return direction == TRIGGER_DIR_BOTH
+	       || (direction == TRIGGER_DIR_RISE && high)
+	       || (direction == TRIGGER_DIR_FALL && !high);
+}
+
+static int64_t fire_at(struct soft_trigger *t, const uint8_t *buf,
+		       uint64_t i)
+{
+	memcpy(t->matched, buf + i * t->unitsize, t->unitsize);
+
+	return i + 1;
+}
+
+/*
+ * Edge, width and count triggers: skip from one level change of the probe
+ * to the next. run counts the samples at the current level, from the edge
+ * that started it; a pulse that was already going when the first buffer
+ * came in has no known width, so it never matches.
+ */
+static int64_t run_edges(struct soft_trigger *t, const uint8_t *buf,
+			 uint64_t num_samples)
+{
+	uint64_t i, next, len;
+	int high, fire;
+
+	if (!num_samples)
+		return -1;
+
+	if (t->level < 0)
+		t->level = (unit_load(buf, t->unitsize) & t->bit) != 0;
+
+	i = 0;
+	while (1) {
+		next = find_sample(t, buf, i, num_samples, t->bit,
+				   t->level ? 0 : t->bit);
+		len = next - i;
+		if (t->type == TRIGGER_TYPE_WIDTH && t->mol == TRIGGER_MOL_MORE
+		    && t->run_valid && direction_matches(t->direction, t->level)
+		    && t->run + len > t->width)
+			return fire_at(t, buf, i + t->width - t->run);
+		t->run += len;
+		if (next == num_samples)
+			return -1;
+
+		/* The probe changes level at sample next. */
+		high = !t->level;
+		fire = FALSE;
+		switch (t->type) {
+		case TRIGGER_TYPE_EDGE:
+			fire = direction_matches(t->direction, high);
+			break;
+		case TRIGGER_TYPE_WIDTH:
+			fire = t->mol == TRIGGER_MOL_LESS && t->run_valid
+			       && direction_matches(t->direction, t->level)
+			       && t->run < t->width;
+			break;
+		case TRIGGER_TYPE_COUNT:
+			fire = high && ++t->edges >= t->count;
+			break;
+		}
+		t->level = high;
+		t->run = 0;
+		t->run_valid = TRUE;
+		if (fire)
+			return fire_at(t, buf, next);
+		i = next;
+	}
+}
+
+/*
+ * The given probe's level in count (at most 64) samples from start on,
+ * one bit per sample. SSE2 compares 16 samples at once, packing the result
+ * down to one byte per sample for the movemask.
+ */
+static uint64_t probe_bits(struct soft_trigger *t, const uint8_t *buf,
+			   uint64_t start, int count, uint64_t bit)
+{
+	uint64_t w;
+	int us, k;
+#ifdef TRIGGER_SSE2
+	const __m128i *p;
+	__m128i m, a, b, c, d;
+#endif
+
+	us = t->unitsize;
+	w = 0;
+	k = 0;
+#ifdef TRIGGER_SSE2
+	switch (us) {
+	case 1:
+		m = _mm_set1_epi8(bit);
+		break;
+	case 2:
+		m = _mm_set1_epi16(bit);
+		break;
+	case 4:
+		m = _mm_set1_epi32(bit);
+		break;
+	default:
+		/* Everything else is done one sample at a time. */
+		m = _mm_setzero_si128();
+		break;
+	}
+	for (; (us == 1 || us == 2 || us == 4) && k + 16 <= count; k += 16) {
+		p = (const __m128i *)(buf + (start + k) * us);
+		a = _mm_and_si128(_mm_loadu_si128(p), m);
+		switch (us) {
+		case 1:
+			a = _mm_cmpeq_epi8(a, m);
+			break;
+		case 2:
+			b = _mm_and_si128(_mm_loadu_si128(p + 1), m);
+			a = _mm_packs_epi16(_mm_cmpeq_epi16(a, m),
+					    _mm_cmpeq_epi16(b, m));
+			break;
+		default:
+			b = _mm_and_si128(_mm_loadu_si128(p + 1), m);
+			c = _mm_and_si128(_mm_loadu_si128(p + 2), m);
+			d = _mm_and_si128(_mm_loadu_si128(p + 3), m);
+			a = _mm_packs_epi32(_mm_cmpeq_epi32(a, m),
+					    _mm_cmpeq_epi32(b, m));
+			c = _mm_packs_epi32(_mm_cmpeq_epi32(c, m),
+					    _mm_cmpeq_epi32(d, m));
+			a = _mm_packs_epi16(a, c);
+			break;
+		}
+		w |= (uint64_t)(_mm_movemask_epi8(a) & 0xffff) << k;
+	}
+#endif
+	for (; k < count; k++) {
+		if (unit_load(buf + (start + k) * us, us) & bit)
+			w |= 1ULL << k;
+	}
+
+	return w;
+}
+
+/* Shift in a bit, returns whether the pattern now matches. */
+static int shift_bit(struct soft_trigger *t, int bit)
+{
+	t->shift = (t->shift << 1) | bit;
+	if (t->num_bits < t->bits)
+		t->num_bits++;
+
+	return t->num_bits == t->bits
+	       && (t->shift & t->mask[0]) == t->value[0];
+}
+
+/*
+ * Serial triggers, 64 samples at a time: the clock (or data) probe's
+ * edges come out of a word of its levels with a shift and a mask, and
+ * only those take any work.
+ */
+static int64_t run_serial(struct soft_trigger *t, const uint8_t *buf,
+			  uint64_t num_samples)
+{
+	uint64_t pos, count, valid, c, d, edges, base, sp, e;
+
+	for (pos = 0; pos < num_samples; pos += count) {
+		count = MIN(num_samples - pos, 64);
+		valid = count == 64 ? ~0ULL : (1ULL << count) - 1;
+		d = probe_bits(t, buf, pos, count, t->bit);
+
+		if (t->clock_bit) {
+			c = probe_bits(t, buf, pos, count, t->clock_bit);
+			if (t->level < 0)
+				t->level = c & 1;
+			edges = c & ~((c << 1) | t->level) & valid;
+			for (; edges; edges &= edges - 1) {
+				e = __builtin_ctzll(edges);
+				if (shift_bit(t, (d >> e) & 1))
+					return fire_at(t, buf, pos + e);
+			}
+			t->level = (c >> (count - 1)) & 1;
+			continue;
+		}
+
+		if (t->level < 0)
+			t->level = d & 1;
+		edges = (d ^ ((d << 1) | t->level)) & valid;
+		base = t->position + pos;
+		while (1) {
+			e = edges ? (uint64_t)__builtin_ctzll(edges) : count;
+			sp = (t->next_point >> 16) - base;
+			if (sp < e) {
+				if (shift_bit(t, (d >> sp) & 1))
+					return fire_at(t, buf, pos + sp);
+				t->next_point += t->period;
+				continue;
+			}
+			if (e == count)
+				break;
+			/* Resynchronize: sample in the middle of each bit. */
+			t->next_point = ((base + e) << 16) + t->period / 2;
+			edges &= edges - 1;
+		}
+		t->level = (d >> (count - 1)) & 1;
+	}
+	t->position += num_samples;
+
+	return -1;
+}
+
+/*
+ * Look for the trigger in the next len bytes of samples. Returns the number
+ * of samples in buf up to and including the last one that matched, or -1 if
+ * the trigger didn't fire. A match may start in earlier buffers. Once it
+ * fired, the matching samples are in trigger->matched.
+ */
+int64_t soft_trigger_run(struct soft_trigger *t, const uint8_t *buf,
+			 uint64_t len)
+{
+	uint8_t stitched[2 * SOFT_TRIGGER_STAGES * 8];
+	uint64_t num_samples, start, last, n, i;
+	int us, hc;
+
+	us = t->unitsize;
+	n = t->num_stages;
+	num_samples = len / us;
+	if (t->type == TRIGGER_TYPE_SERIAL)
+		return run_serial(t, buf, num_samples);
+	if (t->type != TRIGGER_TYPE_LOGIC)
+		return run_edges(t, buf, num_samples);
+	if (n == 0)
+		return 0;
+
+	/*
+	 * Matches starting in earlier buffers: the history holds the last
+	 * n - 1 samples seen, this adds as many from buf as they need.
+	 */
+	hc = t->num_history;
+	last = MIN(num_samples, n - 1);
+	memcpy(stitched, t->history, hc * us);
+	memcpy(stitched + hc * us, buf, last * us);
+	for (i = 0; i < (uint64_t)hc; i++) {
+		if (i + n > hc + last)
+			break;
+		if (match_stages(t, stitched + i * us, 0)) {
+			memcpy(t->matched, stitched + i * us, n * us);
+			return i + n - hc;
+		}
+	}
+
+	/* Matches within buf, going by candidates for the first stage. */
+	start = 0;
+	while (num_samples >= n && start <= num_samples - n) {
+		start = find_sample(t, buf, start, num_samples - n + 1,
+				    t->mask[0], t->value[0]);
+		if (start > num_samples - n)
+			break;
+		if (match_stages(t, buf + (start + 1) * us, 1)) {
+			memcpy(t->matched, buf + start * us, n * us);
+			return start + n;
+		}
+		start++;
+	}
+
+	/* Keep what a match in the next buffer could start with. */
+	if (num_samples >= n - 1) {
+		memcpy(t->history, buf + (num_samples - (n - 1)) * us,
+		       (n - 1) * us);
+		t->num_history = n - 1;
+	} else {
+		last = MIN(hc + num_samples, n - 1);
+		memmove(t->history, stitched + (hc + num_samples - last) * us,
+			last * us);
+		t->num_history = last;
+	}
+
+	return -1;
+}
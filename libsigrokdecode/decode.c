@@ -188,11 +188,24 @@ int sigrokdecode_load_decoder(const char *name,
 	Py_DECREF(py_res);
 	Py_DECREF(py_func);
 
+	/* Decoders that keep state across chunks have a 'Decoder' class. */
+	d->py_class = PyObject_GetAttrString(py_mod, "Decoder");
+	if (!d->py_class) {
+		PyErr_Clear();
+	} else if (!PyCallable_Check(d->py_class)) {
+		Py_DECREF(d->py_class);
+		d->py_class = NULL;
+	}
+
 	/* Get the 'decode' function name as Python callable object. */
 	py_func = PyObject_GetAttrString(py_mod, "decode");
-	if (!py_func || !PyCallable_Check(py_func)) {
+	if (!py_func && d->py_class) {
+		/* Only usable through decoder instances, then. */
+		PyErr_Clear();
+	} else if (!py_func || !PyCallable_Check(py_func)) {
 		if (PyErr_Occurred())
 			PyErr_Print();
+		Py_XDECREF(d->py_class);
 		Py_DECREF(py_mod);
 		return SIGROKDECODE_ERR_PYTHON; /* TODO: More specific error? */
 	}
@@ -227,7 +240,7 @@ int sigrokdecode_run_decoder(struct sigrokdecode_decoder *dec,
 	/* TODO: Use #defines for the return codes. */
 
 	/* Return an error upon unusable input. */
-	if (dec == NULL)
+	if (dec == NULL || dec->py_func == NULL)
 		return SIGROKDECODE_ERR_ARGS; /* TODO: More specific error? */
 	if (inbuf == NULL)
 		return SIGROKDECODE_ERR_ARGS; /* TODO: More specific error? */
@@ -300,6 +313,163 @@ int sigrokdecode_run_decoder(struct sigrokdecode_decoder *dec,
 	return SIGROKDECODE_OK;
 }
 
+/**
+ * Start running a decoder on a new stream of samples.
+ *
+ * Decoders with a 'Decoder' class get a new object of it, which keeps the
+ * decoder's state from one chunk of samples to the next. Others have their
+ * 'decode' function called on every chunk, as sigrokdecode_run_decoder()
+ * does.
+ *
+ * @param dec The decoder, from sigrokdecode_load_decoder().
+ * @param di The new instance is returned here.
+ *
+ * @return SIGROKDECODE_OK upon success, a (negative) error code otherwise.
+ */
+int sigrokdecode_decoder_new_instance(struct sigrokdecode_decoder *dec,
+		struct sigrokdecode_decoder_instance **di)
+{
+	struct sigrokdecode_decoder_instance *d;
+
+	if (dec == NULL || di == NULL)
+		return SIGROKDECODE_ERR_ARGS;
+
+	if (!(d = malloc(sizeof(struct sigrokdecode_decoder_instance))))
+		return SIGROKDECODE_ERR_MALLOC;
+	d->decoder = dec;
+	d->py_obj = NULL;
+	d->py_out = NULL;
+
+	if (dec->py_class) {
+		if (!(d->py_obj = PyObject_CallObject(dec->py_class, NULL))) {
+			PyErr_Print();
+			free(d);
+			return SIGROKDECODE_ERR_PYTHON;
+		}
+	}
+
+	*di = d;
+
+	return SIGROKDECODE_OK;
+}
+
+/*
+ * Hand a decoder's result back as output. The result is kept by the
+ * instance, so the output stays valid until the next call.
+ */
+static int h_output(struct sigrokdecode_decoder_instance *di,
+		    PyObject *py_res, uint8_t **outbuf, uint64_t *outbuflen)
+{
+	const char *buf;
+	Py_ssize_t len;
+
+	Py_XDECREF(di->py_out);
+	di->py_out = py_res;
+	*outbuflen = 0;
+
+	if (py_res == Py_None)
+		return SIGROKDECODE_OK;
+
+	if (PyObject_AsCharBuffer(py_res, &buf, &len)) {
+		PyErr_Print();
+		return SIGROKDECODE_ERR_PYTHON;
+	}
+	*outbuf = (uint8_t *)buf;
+	*outbuflen = len;
+
+	return SIGROKDECODE_OK;
+}
+
+/**
+ * Feed the next chunk of samples to a decoder instance.
+ *
+ * @param di The decoder instance.
+ * @param inbuf The samples.
+ * @param inbuflen Length of inbuf, in bytes.
+ * @param unitsize Size of one sample in inbuf, in bytes.
+ * @param start_samplenum Number of the first sample in inbuf, counted
+ *                        from the start of the stream.
+ * @param outbuf The decoder's output, if any, valid until the next call.
+ * @param outbuflen Length of the output, 0 if there is none.
+ *
+ * @return SIGROKDECODE_OK upon success, a (negative) error code otherwise.
+ */
+int sigrokdecode_decoder_feed(struct sigrokdecode_decoder_instance *di,
+			      uint8_t *inbuf, uint64_t inbuflen, int unitsize,
+			      uint64_t start_samplenum,
+			      uint8_t **outbuf, uint64_t *outbuflen)
+{
+	PyObject *py_res;
+
+	if (di == NULL || inbuf == NULL || inbuflen == 0 || unitsize < 1)
+		return SIGROKDECODE_ERR_ARGS;
+	if (outbuf == NULL || outbuflen == NULL)
+		return SIGROKDECODE_ERR_ARGS;
+
+	/* TODO: int vs. uint64_t for 'inbuflen'? */
+	if (di->py_obj)
+		py_res = PyObject_CallMethod(di->py_obj, "decode", "s#Ki",
+				inbuf, (int)inbuflen,
+				(unsigned PY_LONG_LONG)start_samplenum,
+				unitsize);
+	else
+		py_res = PyObject_CallFunction(di->decoder->py_func, "s#",
+				inbuf, (int)inbuflen);
+	if (!py_res) {
+		PyErr_Print();
+		return SIGROKDECODE_ERR_PYTHON;
+	}
+
+	return h_output(di, py_res, outbuf, outbuflen);
+}
+
+/**
+ * Tell a decoder instance there are no more samples, so it can report
+ * whatever it was still working on.
+ *
+ * @param di The decoder instance.
+ * @param outbuf The decoder's output, if any, valid until the instance
+ *               is destroyed.
+ * @param outbuflen Length of the output, 0 if there is none.
+ *
+ * @return SIGROKDECODE_OK upon success, a (negative) error code otherwise.
+ */
+int sigrokdecode_decoder_end(struct sigrokdecode_decoder_instance *di,
+			     uint8_t **outbuf, uint64_t *outbuflen)
+{
+	PyObject *py_res;
+
+	if (di == NULL || outbuf == NULL || outbuflen == NULL)
+		return SIGROKDECODE_ERR_ARGS;
+
+	*outbuflen = 0;
+	if (!di->py_obj || !PyObject_HasAttrString(di->py_obj, "end"))
+		return SIGROKDECODE_OK;
+
+	if (!(py_res = PyObject_CallMethod(di->py_obj, "end", NULL))) {
+		PyErr_Print();
+		return SIGROKDECODE_ERR_PYTHON;
+	}
+
+	return h_output(di, py_res, outbuf, outbuflen);
+}
+
+/**
+ * Free a decoder instance, and its decoder object.
+ *
+ * @param di The decoder instance.
+ */
+void sigrokdecode_decoder_destroy_instance(
+		struct sigrokdecode_decoder_instance *di)
+{
+	if (di == NULL)
+		return;
+
+	Py_XDECREF(di->py_out);
+	Py_XDECREF(di->py_obj);
+	free(di);
+}
+
 /**
  * Shutdown libsigrokdecode.
  *
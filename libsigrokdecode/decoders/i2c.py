@@ -125,113 +125,134 @@
 #  'signals': [{'SCL': }]}
 #
 
-def decode(inbuf):
-	"""I2C protocol decoder"""
-
-	# FIXME: Get the data in the correct format in the first place.
-	inbuf = [ord(x) for x in inbuf]
-
-	# FIXME: This should be passed in as metadata, not hardcoded here.
-	metadata = {
-	  'numchannels': 8,
-	  'signals': {
-	      'scl': {'ch': 5, 'name': 'SCL', 'desc': 'Serial clock line'},
-	      'sda': {'ch': 7, 'name': 'SDA', 'desc': 'Serial data line'},
-	    },
-	}
+IDLE, START, ADDRESS, DATA = range(4)
+
+# FIXME: This should be passed in as metadata, not hardcoded here.
+metadata = {
+  'numchannels': 8,
+  'signals': {
+      'scl': {'ch': 5, 'name': 'SCL', 'desc': 'Serial clock line'},
+      'sda': {'ch': 7, 'name': 'SDA', 'desc': 'Serial data line'},
+    },
+}
+
+class Decoder():
+	"""I2C protocol decoder
+
+	   Samples are fed in chunks, the state of the bus is kept from one
+	   chunk to the next. Sample numbers count from the first chunk.
+	   Each sample is unitsize bytes, least significant byte first."""
+
+	def __init__(self):
+		# Get the channel/probe number of the SCL/SDA signals.
+		self.scl_bit = metadata['signals']['scl']['ch']
+		self.sda_bit = metadata['signals']['sda']['ch']
 
-	out = []
-	o = ack = d = ''
-	bitcount = data = 0
-	wr = startsample = -1
-	IDLE, START, ADDRESS, DATA = range(4)
-	state = IDLE
-
-	# Get the channel/probe number of the SCL/SDA signals.
-	scl_bit = metadata['signals']['scl']['ch']
-	sda_bit = metadata['signals']['sda']['ch']
-
-	# Get SCL/SDA bit values (0/1 for low/high) of the first sample.
-	s = inbuf[0]
-	oldscl = (s & (1 << scl_bit)) >> scl_bit
-	oldsda = (s & (1 << sda_bit)) >> sda_bit
-
-	# Loop over all samples.
-	# TODO: Handle LAs with more/less than 8 channels.
-	for samplenum, s in enumerate(inbuf[1:]): # We skip the first byte...
-		# Get SCL/SDA bit values (0/1 for low/high).
-		scl = (s & (1 << scl_bit)) >> scl_bit
-		sda = (s & (1 << sda_bit)) >> sda_bit
-
-		# TODO: Wait until the bus is idle (SDA = SCL = 1) first?
-
-		# START condition (S): SDA = falling, SCL = high
-		if (oldsda == 1 and sda == 0) and scl == 1:
-			o = {'type': 'S', 'range': (samplenum, samplenum),
-			     'data': None, 'ann': None},
-			out.append(o)
-			state = ADDRESS
-			bitcount = data = 0
-
-		# Data latching by transmitter: SCL = low
-		elif (scl == 0):
-			pass # TODO
-
-		# Data sampling of receiver: SCL = rising
-		elif (oldscl == 0 and scl == 1):
-			if startsample == -1:
-				startsample = samplenum
-			bitcount += 1
-
-			# out.append("%d\t\tRECEIVED BIT %d:  %d\n" % \
-			# 	(samplenum, 8 - bitcount, sda))
-
-			# Address and data are transmitted MSB-first.
-			data <<= 1
-			data |= sda
-
-			if bitcount != 9:
+		self.oldscl = self.oldsda = None
+		self.bitcount = self.data = 0
+		self.wr = self.startsample = -1
+		self.state = IDLE
+
+	def decode(self, inbuf, start_samplenum=0, unitsize=1):
+		# FIXME: Get the data in the correct format in the first place.
+		inbuf = [ord(x) for x in inbuf]
+
+		out = []
+		scl_bit, sda_bit = self.scl_bit, self.sda_bit
+
+		# Loop over all samples, a partial one at the end is ignored.
+		for i in range(len(inbuf) // unitsize):
+			samplenum = start_samplenum + i
+			s = 0
+			for j in range(unitsize):
+				s |= inbuf[i * unitsize + j] << (8 * j)
+
+			# Get SCL/SDA bit values (0/1 for low/high).
+			scl = (s & (1 << scl_bit)) >> scl_bit
+			sda = (s & (1 << sda_bit)) >> sda_bit
+
+			# The very first sample only gives the initial levels.
+			if self.oldscl is None:
+				self.oldscl, self.oldsda = scl, sda
 				continue
 
-			# We received 8 address/data bits and the ACK/NACK bit.
-			data >>= 1 # Shift out unwanted ACK/NACK bit here.
-			ack = (sda == 1) and 'N' or 'A'
-			d = (state == ADDRESS) and (data & 0xfe) or data
-			if state == ADDRESS:
-				wr = (data & 1) and 1 or 0
-				state = DATA
-			o = {'type': state,
-			     'range': (startsample, samplenum - 1),
-			     'data': d, 'ann': None}
-			if state == ADDRESS and wr == 1:
-				o['type'] = 'AW'
-			elif state == ADDRESS and wr == 0:
-				o['type'] = 'AR'
-			elif state == DATA and wr == 1:
-				o['type'] = 'DW'
-			elif state == DATA and wr == 0:
-				o['type'] = 'DR'
-			out.append(o)
-			o = {'type': ack, 'range': (samplenum, samplenum),
-			     'data': None, 'ann': None}
-			out.append(o)
-			bitcount = data = startsample = 0
-			startsample = -1
-
-		# STOP condition (P): SDA = rising, SCL = high
-		elif (oldsda == 0 and sda == 1) and scl == 1:
-			o = {'type': 'P', 'range': (samplenum, samplenum),
-			     'data': None, 'ann': None},
-			out.append(o)
-			state = IDLE
-			wr = -1
-
-		# Save current SDA/SCL values for the next round.
-		oldscl = scl
-		oldsda = sda
-
-	# FIXME: Just for testing...
-	return str(out)
+			# TODO: Wait until the bus is idle (SDA = SCL = 1)?
+
+			# START condition (S): SDA = falling, SCL = high
+			if (self.oldsda == 1 and sda == 0) and scl == 1:
+				o = {'type': 'S',
+				     'range': (samplenum, samplenum),
+				     'data': None, 'ann': None}
+				out.append(o)
+				self.state = ADDRESS
+				self.bitcount = self.data = 0
+
+			# Data latching by transmitter: SCL = low
+			elif (scl == 0):
+				pass # TODO
+
+			# Data sampling of receiver: SCL = rising
+			elif (self.oldscl == 0 and scl == 1):
+				self.sample_bit(sda, samplenum, out)
+
+			# STOP condition (P): SDA = rising, SCL = high
+			elif (self.oldsda == 0 and sda == 1) and scl == 1:
+				o = {'type': 'P',
+				     'range': (samplenum, samplenum),
+				     'data': None, 'ann': None}
+				out.append(o)
+				self.state = IDLE
+				self.wr = -1
+
+			# Save current SDA/SCL values for the next round.
+			self.oldscl = scl
+			self.oldsda = sda
+
+		if not out:
+			return ''
+		# FIXME: Just for testing...
+		return str(out)
+
+	def sample_bit(self, sda, samplenum, out):
+		if self.startsample == -1:
+			self.startsample = samplenum
+		self.bitcount += 1
+
+		# Address and data are transmitted MSB-first.
+		self.data <<= 1
+		self.data |= sda
+
+		if self.bitcount != 9:
+			return
+
+		# We received 8 address/data bits and the ACK/NACK bit.
+		self.data >>= 1 # Shift out unwanted ACK/NACK bit here.
+		ack = (sda == 1) and 'N' or 'A'
+		if self.state == ADDRESS:
+			d = self.data & 0xfe
+			# R/W bit: 0 for a write, 1 for a read.
+			self.wr = 1 - (self.data & 1)
+			t = self.wr and 'AW' or 'AR'
+			self.state = DATA
+		else:
+			d = self.data
+			t = self.wr and 'DW' or 'DR'
+		o = {'type': t, 'range': (self.startsample, samplenum - 1),
+		     'data': d, 'ann': None}
+		out.append(o)
+		o = {'type': ack, 'range': (samplenum, samplenum),
+		     'data': None, 'ann': None}
+		out.append(o)
+		self.bitcount = self.data = 0
+		self.startsample = -1
+
+	def end(self):
+		# Nothing is held back, a transfer that was cut off is dropped.
+		return ''
+
+def decode(inbuf):
+	"""I2C protocol decoder, on a single buffer of samples"""
+	return Decoder().decode(inbuf) or str([])
 
 def register():
 	return {
@@ -249,7 +270,7 @@ def register():
 # Use psyco (if available) as it results in huge performance improvements.
 try:
 	import psyco
-	psyco.bind(decode)
+	psyco.bind(Decoder)
 except ImportError:
 	pass
 
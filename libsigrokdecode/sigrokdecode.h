@@ -60,6 +60,19 @@ struct sigrokdecode_decoder {
 
 	PyObject *py_mod;
 	PyObject *py_func;
+	/* The module's Decoder class, if it has one */
+	PyObject *py_class;
+};
+
+/*
+ * A decoder running on one stream of samples, fed in chunks. Decoders with
+ * a Decoder class get an object of it, keeping their state across chunks.
+ */
+struct sigrokdecode_decoder_instance {
+	struct sigrokdecode_decoder *decoder;
+	PyObject *py_obj;
+	/* The last output, kept until the next call */
+	PyObject *py_out;
 };
 
 int sigrokdecode_init(void);
@@ -68,6 +81,16 @@ int sigrokdecode_load_decoder(const char *name, struct sigrokdecode_decoder **de
 int sigrokdecode_run_decoder(struct sigrokdecode_decoder *dec,
 			     uint8_t *inbuf, uint64_t inbuflen,
 			     uint8_t **outbuf, uint64_t *outbuflen);
+int sigrokdecode_decoder_new_instance(struct sigrokdecode_decoder *dec,
+		struct sigrokdecode_decoder_instance **di);
+int sigrokdecode_decoder_feed(struct sigrokdecode_decoder_instance *di,
+			      uint8_t *inbuf, uint64_t inbuflen, int unitsize,
+			      uint64_t start_samplenum,
+			      uint8_t **outbuf, uint64_t *outbuflen);
+int sigrokdecode_decoder_end(struct sigrokdecode_decoder_instance *di,
+			     uint8_t **outbuf, uint64_t *outbuflen);
+void sigrokdecode_decoder_destroy_instance(
+		struct sigrokdecode_decoder_instance *di);
 int sigrokdecode_shutdown(void);
 
 #endif